@@ -0,0 +1,103 @@
+/*
+ * Free-list order benchmark: churn a ring of live blocks next to a large
+ * pool of cold holes, touching each block as it is handed out. Address
+ * order tends to hand back a low, long-idle hole; LIFO order the chunk
+ * that was just freed. Cache misses are read from perf when the kernel
+ * allows it; the time per round (one free, one malloc and the touching
+ * around them) is printed in nanoseconds either way.
+ *
+ *     ./bench1 [address|lifo]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "malloc.h"
+
+#define HOLES 8192
+#define RING 256
+#define ROUNDS 200000
+#define STREAM (64 * 1024 * 1024)
+#define STREAM_STEP 4096
+
+static const size_t sizes[] = { 320, 480, 640, 960 };
+
+static int open_misses(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.exclude_kernel = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+int main(int argc, char **argv)
+{
+    static char *holes[HOLES], *pins[HOLES], *ring[RING];
+    char *stream = malloc(STREAM);
+    struct timespec start, end;
+    long long misses = -1;
+    size_t i, offset = 0;
+    unsigned seed = 1;
+    int fd;
+
+    if (argc > 1 && strcmp(argv[1], "lifo") == 0) {
+        mallopt(M_FREE_ORDER, MALLOC_ORDER_LIFO);
+    }
+    memset(stream, 1, STREAM);
+
+    /* Cold holes at low addresses, kept apart by pinned blocks */
+    for(i = 0; i < HOLES; i++){
+        holes[i] = malloc(1008);
+        pins[i] = malloc(400);
+    }
+    for(i = 0; i < HOLES; i++){
+        free(holes[i]);
+    }
+    for(i = 0; i < RING; i++){
+        ring[i] = malloc(sizes[i % 4]);
+    }
+
+    fd = open_misses();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < ROUNDS; i++){
+        size_t j = i % RING, size = sizes[rand_r(&seed) % 4];
+
+        /* The block is used right up to its free */
+        memset(ring[j], 2, 64);
+        free(ring[j]);
+        ring[j] = malloc(size);
+        memset(ring[j], 3, size);
+
+        /* Other work pushes idle memory out of the cache */
+        memset(stream + offset, 4, STREAM_STEP);
+        offset = (offset + STREAM_STEP) % STREAM;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (fd >= 0 && read(fd, &misses, sizeof(misses)) != sizeof(misses)) {
+        misses = -1;
+    }
+
+    printf("%s: %.1f ns per round", argc > 1 ? argv[1] : "address",
+        ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / ROUNDS);
+    if (misses >= 0) {
+        printf(", %.2f cache misses per round", (double) misses / ROUNDS);
+    }
+    printf("\n");
+
+    for(i = 0; i < RING; i++){
+        free(ring[i]);
+    }
+    for(i = 0; i < HOLES; i++){
+        free(pins[i]);
+    }
+    free(stream);
+    return 0;
+}
@@ -0,0 +1,238 @@
+/*
+ * I/O buffer pool. One reserved range is carved into slabs from the bottom
+ * up, each slab into buffers of one class. A table with an entry per
+ * IOBUF_UNIT of the range records the class, so buffers carry no header
+ * and stay page-aligned. Free buffers link through their first word.
+ */
+
+#define _GNU_SOURCE
+#include "iobuf.h"
+#include "memreq.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Address space for all slabs, and the granularity of the class table */
+#define IOBUF_RESERVE ((size_t) 64 << 30)
+#define IOBUF_UNIT ((size_t) 1 << 20)
+#define IOBUF_UNITS (IOBUF_RESERVE / IOBUF_UNIT)
+
+/* Buffers a slab holds at least, and bytes a thread caches per class */
+#define SLAB_BUFFERS 8
+#define CACHE_BYTES ((size_t) 1 << 20)
+#define CACHE_COUNT 16
+
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+#define CLASS_SIZE(c) (pool.page << (c))
+#define SLAB_SIZE(c) MAX(CLASS_SIZE(c) * SLAB_BUFFERS, IOBUF_UNIT)
+#define CACHE_LIMIT(c) MAX(MIN(CACHE_BYTES / CLASS_SIZE(c), CACHE_COUNT), 1)
+
+struct iobuf_pool {
+    const struct memreq_backend *backend;
+    /* Reserved range, page-aligned, and the end of the slabs in it */
+    char *base;
+    char *brk;
+    char *limit;
+    size_t page;
+    int flags;
+    iobuf_register_t callback;
+    void *arg;
+    /* Free buffers per class, most recently freed first */
+    void *lists[IOBUF_CLASSES];
+    /* Class + 1 of each unit of the range; 0 if no slab there yet */
+    unsigned char classes[IOBUF_UNITS];
+    pthread_mutex_t lock;
+};
+
+struct iobuf_cache {
+    void *bins[IOBUF_CLASSES];
+    unsigned counts[IOBUF_CLASSES];
+    /* Set once the destructor that flushes it is registered */
+    char registered;
+};
+
+static struct iobuf_pool pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static __thread struct iobuf_cache cache __attribute__((tls_model("initial-exec")));
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+#define NEXT(buf) (*(void**) (buf))
+
+/* The class of the buffer at 'ptr', which must be one of the pool's. */
+static unsigned iobuf_class_at(void *ptr)
+{
+    size_t unit = ((char*) ptr - pool.base) / IOBUF_UNIT;
+
+    assert((char*) ptr >= pool.base && (char*) ptr < pool.brk && pool.classes[unit] != 0);
+    return pool.classes[unit] - 1;
+}
+
+static unsigned iobuf_class_of(size_t size)
+{
+    unsigned c = 0;
+
+    while (CLASS_SIZE(c) < size) {
+        c++;
+    }
+    return c;
+}
+
+/* Reserve the range. Called with the pool lock held. */
+static int iobuf_start(void)
+{
+    size_t reserved = IOBUF_RESERVE;
+    char *start;
+
+    if (NULL == pool.backend) {
+        pool.backend = &memreq_mmap;
+    }
+    if ((start = pool.backend->reserve(pool.backend->data, &reserved)) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    pool.base = (char*) (((uintptr_t) start + pool.page - 1) & ~(uintptr_t) (pool.page - 1));
+    pool.brk = pool.base;
+    pool.limit = pool.base + MIN(reserved - (pool.base - start), IOBUF_RESERVE) / IOBUF_UNIT * IOBUF_UNIT;
+    return 0;
+}
+
+/* Carve a new slab for class 'c'. Called with the pool lock held; returns one buffer. */
+static void *iobuf_slab(unsigned c)
+{
+    size_t size = SLAB_SIZE(c), i;
+    char *slab;
+
+    if (NULL == pool.base && iobuf_start() != 0) {
+        return NULL;
+    }
+    slab = pool.brk;
+    if (size > (size_t) (pool.limit - slab) || pool.backend->commit(pool.backend->data, slab, size) != 0) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if ((pool.flags & IOBUF_MLOCK) && mlock(slab, size) != 0) {
+        pool.backend->decommit(pool.backend->data, slab, size);
+        return NULL;
+    }
+    pool.brk += size;
+    for (i = 0; i < size / IOBUF_UNIT; i++) {
+        pool.classes[(slab - pool.base) / IOBUF_UNIT + i] = c + 1;
+    }
+    if (pool.callback) {
+        pool.callback(slab, size, pool.arg);
+    }
+    /* Lowest addresses on top of the list */
+    for (i = size - CLASS_SIZE(c); i > 0; i -= CLASS_SIZE(c)) {
+        NEXT(slab + i) = pool.lists[c];
+        pool.lists[c] = slab + i;
+    }
+    return slab;
+}
+
+/* Give a thread's cached buffers back to the pool when it exits. */
+static void iobuf_cache_flush(void *arg)
+{
+    struct iobuf_cache *tc = arg;
+    void *buf;
+    unsigned c;
+
+    pthread_mutex_lock(&pool.lock);
+    for (c = 0; c < IOBUF_CLASSES; c++) {
+        while ((buf = tc->bins[c]) != NULL) {
+            tc->bins[c] = NEXT(buf);
+            NEXT(buf) = pool.lists[c];
+            pool.lists[c] = buf;
+        }
+        tc->counts[c] = 0;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    tc->registered = 0;
+}
+
+static void iobuf_cache_key_create(void)
+{
+    pthread_key_create(&cache_key, iobuf_cache_flush);
+}
+
+int iobuf_configure(int flags, const struct memreq_backend *backend, iobuf_register_t callback, void *arg)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.base != NULL) {
+        errno = EBUSY;
+        ret = -1;
+    } else {
+        pool.flags = flags;
+        pool.backend = backend;
+        pool.callback = callback;
+        pool.arg = arg;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return ret;
+}
+
+void *iobuf_alloc(size_t size)
+{
+    void *buf;
+    unsigned c;
+
+    if (0 == pool.page) {
+        pool.page = sysconf(_SC_PAGESIZE);
+    }
+    if (0 == size || size > CLASS_SIZE(IOBUF_CLASSES - 1)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    c = iobuf_class_of(size);
+    if ((buf = cache.bins[c]) != NULL) {
+        cache.bins[c] = NEXT(buf);
+        cache.counts[c]--;
+        return buf;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    if ((buf = pool.lists[c]) != NULL) {
+        pool.lists[c] = NEXT(buf);
+    } else {
+        buf = iobuf_slab(c);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return buf;
+}
+
+void iobuf_free(void *ptr)
+{
+    unsigned c;
+
+    if (NULL == ptr) {
+        return;
+    }
+    c = iobuf_class_at(ptr);
+    if (cache.counts[c] < CACHE_LIMIT(c)) {
+        if (!cache.registered) {
+            pthread_once(&cache_once, iobuf_cache_key_create);
+            pthread_setspecific(cache_key, &cache);
+            cache.registered = 1;
+        }
+        NEXT(ptr) = cache.bins[c];
+        cache.bins[c] = ptr;
+        cache.counts[c]++;
+        return;
+    }
+    pthread_mutex_lock(&pool.lock);
+    NEXT(ptr) = pool.lists[c];
+    pool.lists[c] = ptr;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+size_t iobuf_size(void *ptr)
+{
+    return CLASS_SIZE(iobuf_class_at(ptr));
+}
@@ -0,0 +1,48 @@
+#ifndef IOBUF_H
+#define IOBUF_H
+
+#include <stddef.h>
+
+#include "malloc.h"
+
+/*
+ * A pool of I/O buffers: page-aligned, a power-of-two number of pages, up
+ * to IOBUF_CLASSES sizes. Buffers come from slabs that are never given
+ * back, and are reused most recently freed first, through a small cache
+ * per thread, so the same few addresses stay hot. Suits O_DIRECT and
+ * registered-buffer I/O; keep them apart from the general heap.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Sizes: one page up to IOBUF_CLASSES - 1 doublings of it */
+#define IOBUF_CLASSES 11
+
+/* iobuf_configure flags */
+/* Lock every slab in memory as it is made */
+#define IOBUF_MLOCK 1
+
+struct memreq_backend;
+
+/* Called once for each new slab, e.g. to register it with the kernel or a device. */
+typedef void (*iobuf_register_t)(void *start, size_t size, void *arg);
+
+/* 
+ * Set up the pool before its first buffer is handed out. A NULL backend
+ * is memreq_mmap. 0, or -1 with EBUSY if the pool is already in use.
+ */
+int iobuf_configure(int flags, const struct memreq_backend *backend, iobuf_register_t callback, void *arg) MALLOC_NOTHROW;
+
+/* NULL with errno set on failure; EINVAL if 'size' is 0 or above the largest class. */
+void* iobuf_alloc(size_t size) MALLOC_NOTHROW;
+void iobuf_free(void *ptr) MALLOC_NOTHROW;
+/* The buffer's whole size, 'size' rounded up to its class. */
+size_t iobuf_size(void *ptr) MALLOC_NOTHROW;
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* IOBUF_H */
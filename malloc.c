@@ -12,10 +12,17 @@
 #include <pthread.h>
 #endif /* PTHREAD_COMPILE != 0 */
 
+/* Set to 0 to turn off the per-thread cache of small chunks */
+#define TCACHE_COMPILE 1
+
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <unistd.h>
+#include <sched.h>
 #include <assert.h>
+#include <stdint.h>
+#include <time.h>
 
 #include "malloc.h"
 #include "memreq.h"
@@ -35,7 +42,30 @@
 #define SET_USED(x) ((x) |= 1)
 #define SET_FREE(x) ((x) &= (~1))
 #define ISUSED(x) ((x) & (1))
-#define GETSIZE(x) (((x)>>1)<<1)
+#define GETSIZE(x) ((x) & ~(size_t)15 & ~TAG_MASK)
+
+/* 
+ * A used chunk's allocation tag sits in the top byte of its header; free
+ * chunks, footers and tag 0 leave it clear.
+ */
+#define TAG_SHIFT 56
+#define TAG_MASK (~(size_t)0 << TAG_SHIFT)
+#define GETTAG(x) ((unsigned) ((x) >> TAG_SHIFT))
+/* Bytes and blocks a thread counts before folding them into the totals */
+#define TAG_SLACK_BYTES (256 * 1024)
+#define TAG_SLACK_BLOCKS 64
+
+/* 
+ * Chunks mapped on their own; FRESH ones have never been written to,
+ * FILE ones are backed by a file of their own (a memfd or a spill file)
+ * instead of anonymous memory.
+ */
+#define MMAPPED_BIT 2
+#define FRESH_BIT 4
+#define FILE_BIT 8
+#define ISMMAPPED(x) ((x) & MMAPPED_BIT)
+#define ISFRESH(x) ((x) & FRESH_BIT)
+#define ISFILE(x) ((x) & FILE_BIT)
 
 /* Round up to nearest sizes. */
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
@@ -43,7 +73,56 @@
 #define ROUNDUP_8(x) (((((x)-1)>>3)+1)<<3)
 #define ROUNDUP_16(x) (((((x)-1)>>4)+1)<<4)
 #define ROUNDUP_PAGE(x) (((((x)-1)/PAGE_SIZE)+1)*PAGE_SIZE)
+#define ROUNDDOWN_PAGE(x) ((x) & ~(uintptr_t)(PAGE_SIZE-1))
 #define ROUNDUP_CHUNK(x) ROUNDUP_16(MAX((x),DIFF_OVERHEAD)+FENCE_OVERHEAD) // ROUNDUP_16(MAX((x),NODE_OVERHEAD))
+#define ROUNDUP_ALIGN(x, a) (((x)+(a)-1) & ~((uintptr_t)(a)-1))
+#define ISPOW2(x) ((x) != 0 && ((x) & ((x)-1)) == 0)
+
+/* Decode the *allocx flags */
+#define FLAGS_ALIGNMENT(f) (((f) & MALLOCX_ALIGN_MASK) ? (size_t) 1 << ((f) & MALLOCX_ALIGN_MASK) : 0)
+#define FLAGS_ARENA(f) ((((unsigned)(f)) >> 20) - 1)
+
+/* Size classes: chunk sizes from ROUNDUP_CHUNK(0) up in ALIGN_SIZE steps */
+#define CLASS_CHUNK(c) (ROUNDUP_CHUNK(0)+(size_t)(c)*ALIGN_SIZE)
+#define CLASS_OF(x) (((x)-ROUNDUP_CHUNK(0))/ALIGN_SIZE)
+#define CLASS_MAX_CHUNK CLASS_CHUNK(MALLOC_CLASS_COUNT-1)
+#define TCACHE_COUNT 16
+
+/* Recently grown blocks tracked per thread, and growths before headroom */
+#define GROW_ENTRIES 8
+#define GROW_STREAK 2
+
+/* Large-mapping cache: size buckets (log2 above 128 KiB), slots per bucket */
+#define MCACHE_BUCKETS 10
+#define MCACHE_SLOTS 4
+#define MCACHE_BUCKET(x) MIN(highest((x) >> 17), MCACHE_BUCKETS-1)
+
+/* Zero pool: chunks from 1 KiB, log2 buckets, clean chunks kept per bucket */
+#define ZPOOL_MIN_CHUNK 1024
+#define ZPOOL_BUCKETS 8
+#define ZPOOL_BUCKET(x) MIN(highest((x) / ZPOOL_MIN_CHUNK) - 1, ZPOOL_BUCKETS-1)
+#define ZPOOL_BUCKET_CHUNK(b) ((ZPOOL_MIN_CHUNK << ((b)+1)) - ALIGN_SIZE)
+#define ZPOOL_TARGET 2
+
+/* Parallel fill/copy: each thread's share is a multiple of this */
+#define PAR_GRAIN (64 * 1024)
+
+/* Deferred frees a thread collects before trying to advance the epoch */
+#define EPOCH_BATCH 64
+
+/* Arenas at most, and the address space each one past the first reserves */
+#define ARENA_MAX 16
+#define ARENA_RESERVE ((size_t) 1 << 30)
+
+/* Buddy arenas: blocks of BUDDY_MIN << k bytes for k < BUDDY_ORDERS */
+#define BUDDY_MIN_SHIFT 5
+#define BUDDY_MIN ((size_t) 1 << BUDDY_MIN_SHIFT)
+#define BUDDY_ORDERS 24
+#define BUDDY_SPAN (BUDDY_MIN << (BUDDY_ORDERS-1))
+#define BUDDY_BLOCKS (BUDDY_SPAN >> BUDDY_MIN_SHIFT)
+
+/* Arenas on a backend of the caller's choosing keep their large chunks too */
+#define ARENA_MAPS_LARGE(a) ((a) == arenas || (a)->backend == &memreq_mmap)
 
 /* Get a pointer to the previous neighoring fence */
 #define FENCE_BACKWARD(x) ((fence_t)(x)-1)
@@ -63,34 +142,404 @@ typedef struct fnode {
     struct fnode *next;
 } *fnode_t;
 
+_Static_assert(MALLOC_CLASS_SIZE(0)+FENCE_OVERHEAD == CLASS_CHUNK(0) &&
+    MALLOC_CLASS_SIZE(1)+FENCE_OVERHEAD == CLASS_CHUNK(1),
+    "malloc.h size classes disagree with ROUNDUP_CHUNK");
+
+/* 
+ * Header of a chunk mapped on its own, right before the user data. The
+ * fence holds the usable size plus FENCE_OVERHEAD like a heap chunk; there
+ * is no back fence. The mapping starts at the page holding the header.
+ */
+typedef struct mchunk {
+    size_t length;
+    struct fence fence;
+} *mchunk_t;
+
+#define MCHUNK_SIZE (sizeof(struct mchunk))
+#define MCHUNK_OF(ptr) ((mchunk_t) ((char*)(ptr) - MCHUNK_SIZE))
+#define MCHUNK_BASE(m) ((char*) ROUNDDOWN_PAGE((uintptr_t)(m)))
+
+/* 
+ * A file-backed mchunk has its descriptor in front. Once cloned, the
+ * file is sealed and every block mapping it is a private copy of it.
+ * The file never shrinks under whoever else has it mapped, so it can
+ * be longer than the chunk; file_size is how long it really is.
+ */
+typedef struct fdchunk {
+    int fd;
+    int cloned;
+    size_t file_size;
+    struct mchunk chunk;
+} *fdchunk_t;
+
+#define FDCHUNK_SIZE (sizeof(struct fdchunk))
+_Static_assert(FDCHUNK_SIZE % ALIGN_SIZE == 0, "fdchunk keeps the user data aligned");
+#define FDCHUNK_OF(m) ((fdchunk_t) ((char*)(m) - offsetof(struct fdchunk, chunk)))
+
+/* A freed mapping kept for reuse, and when it was freed (in ms). */
+struct mcache_entry {
+    char *base;
+    size_t length;
+    uint64_t stamp;
+};
+
+/* 
+ * Pool of medium chunks zeroed by a background thread. Freed chunks queue
+ * on 'dirty'; the worker zeroes them, files them in 'clean' by size and
+ * tops empty buckets up from the heap. Pooled chunks stay marked used.
+ */
+struct zpool {
+    fnode_t dirty;
+    fnode_t clean[ZPOOL_BUCKETS];
+    unsigned counts[ZPOOL_BUCKETS];
+    /* Bytes held, dirty and clean, and the limit (mallopt) */
+    size_t bytes;
+    size_t max;
+    char started;
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    #endif /* PTHREAD_COMPILE != 0 */
+};
+
+/* 
+ * Helper threads splitting one large zero-fill or copy between them and the
+ * caller. Only one job runs at a time; other callers work alone.
+ */
+struct par {
+    /* The job: copy from 'src', or zero when it is NULL */
+    char *dst;
+    const char *src;
+    size_t len;
+    size_t part;
+    /* Parts handed out and parts finished */
+    unsigned parts, next, finished;
+    /* Threads started, threads wanted (mallopt) and the size to split at */
+    unsigned threads, want;
+    size_t threshold;
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_t busy;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    #endif /* PTHREAD_COMPILE != 0 */
+};
+
+/* 
+ * Chunks freed asynchronously, waiting for the reclaimer thread. Pushing
+ * past 'max' queued bytes makes the caller free synchronously instead.
+ */
+struct reclaim {
+    fnode_t queue;
+    size_t bytes;
+    /* Queue limit and the size from which free() goes async (mallopt) */
+    size_t max;
+    size_t threshold;
+    char started;
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    #endif /* PTHREAD_COMPILE != 0 */
+};
+
+/* 
+ * Epoch-based reclamation. Readers announce the global epoch they entered
+ * in; a chunk deferred in epoch 'e' is released once the epoch reaches
+ * e+2, when no reader can still see it. Each thread keeps one bag per
+ * epoch. Readers may still look at deferred chunks, so the bags hold their
+ * pointers in separately allocated blocks instead of linking through them.
+ */
+struct eblock {
+    struct eblock *next;
+    unsigned count;
+    void *ptrs[EPOCH_BATCH];
+};
+
+struct ebag {
+    struct eblock *blocks;
+    uint64_t epoch;
+    unsigned count;
+};
+
+struct ethread {
+    /* Entered epoch << 1, low bit set while inside a read section */
+    uint64_t state;
+    struct ethread *next;
+    struct ebag bags[3];
+    unsigned pending;
+    char registered;
+};
+
+/* 
+ * Per-thread stacks of free small chunks, one per size class. Cached chunks
+ * stay marked used, so they never coalesce until flushed back to the heap.
+ */
+struct tcache {
+    fnode_t bins[MALLOC_CLASS_COUNT];
+    unsigned counts[MALLOC_CLASS_COUNT];
+    char registered;
+};
+
+/* 
+ * Limits on a tag's live bytes. Tags with one are counted straight into
+ * the totals, so the limits see every thread's blocks.
+ */
+struct tag_limit {
+    size_t soft;
+    size_t hard;
+    malloc_tag_hook_t hook;
+    void *arg;
+};
+
+/* A thread's current tag, and what it has counted but not yet folded in */
+struct tag_deltas {
+    long bytes[MALLOC_TAG_COUNT];
+    long blocks[MALLOC_TAG_COUNT];
+    unsigned current;
+    char registered;
+};
+
+/* 
+ * Bookkeeping of a buddy arena, at the start of its reserved range. The
+ * blocks have no headers, so a power-of-two request gets a block of just
+ * that size; the order of each allocated block is kept on the side. One
+ * bit per buddy pair and order says whether exactly one of them is free,
+ * so a free merges upwards by flipping bits, without reading the buddy.
+ */
+struct buddy {
+    fnode_t lists[BUDDY_ORDERS];
+    /* Order + 1 of the block allocated at each minimum block, else 0 */
+    unsigned char orders[BUDDY_BLOCKS];
+    unsigned char pairs[BUDDY_BLOCKS / 8];
+    /* BUDDY_SPAN bytes aligned to their size, so blocks are too */
+    char *heap;
+};
+
+/* 
+ * A first-fit heap with its own free list and lock. Arena 0 grows with
+ * sbrk; the others commit pages out of a range reserved up front, so the
+ * arena a chunk belongs to is known from its address.
+ */
+struct arena {
+    fnode_t flist;
+    /* First chunk and the end of the committed part */
+    char *start;
+    char *brk;
+    /* Reserved range; NULL for the sbrk heap */
+    char *base;
+    char *limit;
+    /* Where the range came from; the sbrk heap grows the break itself */
+    const struct memreq_backend *backend;
+    /* Freed chunks may go through the thread cache */
+    char cached;
+    /* MALLOC_ORDER_* of the free list */
+    char order;
+    /* MALLOC_FIT_* placement, where next-fit resumes, and search counts */
+    char fit;
+    fnode_t rover;
+    struct malloc_fit_stats stats[MALLOC_FIT_COUNT];
+    /* Set for buddy arenas, which use none of the above but the range */
+    struct buddy *buddy;
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_t lock;
+    #endif /* PTHREAD_COMPILE != 0 */
+};
+
+/* 
+ * A block that realloc has grown 'streak' times in a row, and its usable
+ * size since; a block later handed out at the same address rarely has it.
+ */
+struct grow_entry {
+    void *ptr;
+    size_t size;
+    unsigned streak;
+};
+
 /* Global variables */
 
 /* Size of memory page in bytes */
 static size_t PAGE_SIZE = 0;
-/* Head of free nodes list */
-static fnode_t flist = NULL;
-/* Pointer to the start of the heap */
-static char *HEAP_START = NULL;
-/* Pointer to the break */
-static char *HEAP_BREAK = NULL;
+/* The sbrk heap first, then arenas added by malloc_arena_create */
+#if PTHREAD_COMPILE != 0
+static struct arena arenas[ARENA_MAX] = { { .backend = &memreq_sbrk, .cached = 1, .lock = PTHREAD_MUTEX_INITIALIZER } };
+#else
+static struct arena arenas[ARENA_MAX] = { { .backend = &memreq_sbrk, .cached = 1 } };
+#endif /* PTHREAD_COMPILE != 0 */
+static unsigned arena_count = 1;
+/* Free-list order and placement new arenas start with (mallopt) */
+static char free_order = MALLOC_ORDER_ADDRESS;
+static char fit_policy = MALLOC_FIT_FIRST;
+/* Fitting nodes good-fit compares before taking the best of them */
+static unsigned good_fit_count = 8;
+/* 
+ * Arenas made on first use, 0 until then and -1 if that failed: one for
+ * the size classes, so small chunks never sit between medium free space,
+ * and the ones malloc_hint routes short- and long-lived blocks to.
+ */
+static int small_arena;
+static int lifetime_arenas[2];
 /* Mutex lock using pthread */
 #if PTHREAD_COMPILE != 0
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t arenas_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t mcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif /* PTHREAD_COMPILE != 0 */
+/* Chunks of at least this size are mapped on their own (mallopt) */
+static size_t mmap_threshold = 128 * 1024;
+/* Mapped chunks of at least this size get a memfd; 0 is never (mallopt) */
+static size_t memfd_threshold = 0;
+/* 
+ * Spilling mapped chunks to unlinked files in a directory (malloc_spill):
+ * from this size on, or once the footprint (heap growth and live mapped
+ * chunks) is over the budget. 0 turns either off. 'users' counts the
+ * blocks making a file in 'dir' right now; it is closed only once they
+ * are done.
+ */
+static struct {
+    int dir;
+    int users;
+    size_t threshold;
+    size_t budget;
+} spill = { -1, 0, 0, 0 };
+static size_t footprint = 0;
+/* Freed mappings kept for reuse, their total and limits (mallopt) */
+static struct mcache_entry mcache[MCACHE_BUCKETS][MCACHE_SLOTS];
+static size_t mcache_bytes = 0;
+static size_t mcache_max = 64 * 1024 * 1024;
+static uint64_t mcache_decay_ms = 1000;
+/* Pre-zeroed chunks for calloc; off until mallopt(M_ZERO_POOL) */
+#if PTHREAD_COMPILE != 0
+static struct zpool zpool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER
+};
+/* Helpers for huge zero-fills and copies; off until mallopt(M_PARALLEL_THREADS) */
+static struct par par = {
+    .threshold = 64 * 1024 * 1024,
+    .busy = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER
+};
+/* Background release of large chunks; free() uses it from 'threshold' on */
+static struct reclaim reclaim = {
+    .max = 256 * 1024 * 1024,
+    .threshold = 0,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER
+};
+#endif /* PTHREAD_COMPILE != 0 */
+/* Epochs: the global one, every reader thread, and bags of exited threads */
+static uint64_t epoch_global = 0;
+static struct ethread *epoch_threads = NULL;
+static struct ebag epoch_orphans;
+static __thread struct ethread ethread __attribute__((tls_model("initial-exec")));
+#if PTHREAD_COMPILE != 0
+static pthread_mutex_t epoch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+#endif /* PTHREAD_COMPILE != 0 */
+/* Blocks realloc grew recently on this thread */
+static __thread struct grow_entry grow_table[GROW_ENTRIES] __attribute__((tls_model("initial-exec")));
+static __thread unsigned grow_next __attribute__((tls_model("initial-exec")));
+/* Live bytes and blocks per tag, short of what threads still hold */
+static struct malloc_tag_stats tag_totals[MALLOC_TAG_COUNT];
+static struct tag_limit tag_limits[MALLOC_TAG_COUNT];
+static __thread struct tag_deltas tag_deltas __attribute__((tls_model("initial-exec")));
+#if PTHREAD_COMPILE != 0
+static pthread_key_t tag_key;
+static pthread_once_t tag_once = PTHREAD_ONCE_INIT;
+#endif /* PTHREAD_COMPILE != 0 */
+#if TCACHE_COMPILE != 0
+static __thread struct tcache tcache __attribute__((tls_model("initial-exec")));
+#if PTHREAD_COMPILE != 0
+/* Flushes a thread's cache when it exits */
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
 #endif /* PTHREAD_COMPILE != 0 */
+#endif /* TCACHE_COMPILE != 0 */
 
 /* Helper-function declarations. Explained before each function definition. */
 
-static fnode_t malloc_expand(size_t size);
+static fnode_t malloc_expand(struct arena *arena, size_t size);
 static fnode_t malloc_fnode_assign_free(char *start, size_t size);
 static void *malloc_fnode_assign_used(char *start, size_t size);
-static fnode_t malloc_find_fit(fnode_t target, size_t size);
-static fnode_t malloc_fnode_split(fnode_t *list, fnode_t node, size_t size);
-static void malloc_fnode_release(fnode_t *list, fence_t item);
-static fnode_t malloc_fnode_fuse_up(fnode_t *list, fnode_t node);
-static fnode_t malloc_fnode_fuse_down(fnode_t *list, fnode_t node);
+static void malloc_fnode_set_used(fence_t target, size_t size);
+static fnode_t malloc_find_fit(struct arena *arena, size_t size);
+static void *malloc_aligned(struct arena *arena, size_t alignment, size_t size);
+static void *malloc_chunk(struct arena *arena, size_t size);
+static struct arena *malloc_arena_of(void *chunk);
+static void *malloc_arena_alloc(struct arena *arena, size_t size);
+static void *malloc_grow(void *ptr, size_t size, size_t alloc, size_t used, size_t old_size);
+static struct arena *malloc_arena_lazy(int *slot, char cached);
+static void *malloc_size_chunk(size_t size);
+static struct buddy *malloc_buddy_of(void *ptr);
+static void *malloc_buddy_alloc(struct arena *arena, size_t size);
+static void malloc_buddy_release(struct buddy *buddy, char *block);
+static size_t malloc_buddy_size(struct buddy *buddy, char *block);
+static int malloc_flags_valid(int flags);
+static void malloc_release(fence_t target);
+static void *malloc_mmap(size_t size, size_t alignment);
+static void *malloc_mremap(void *ptr, size_t size, int may_move);
+static void *malloc_mmap_file(size_t size, int fd);
+static size_t malloc_mmap_header(size_t size, size_t alignment);
+static int malloc_spill_over(size_t size, int budget);
+static void malloc_munmap(mchunk_t chunk);
+static char *malloc_mcache_get(size_t length, size_t *got);
+static int malloc_mcache_put(char *base, size_t length);
+static void malloc_mcache_decay(uint64_t now);
+static inline size_t highest(size_t in);
+static inline void malloc_zero(void *ptr, size_t n);
+static inline void malloc_zero_words(void *ptr, size_t n);
+static inline void malloc_copy_words(void *dst, const void *src, size_t n);
+#if PTHREAD_COMPILE != 0
+static int malloc_zpool_start(size_t max);
+static int malloc_zpool_put(fence_t target);
+static void *malloc_zpool_get(size_t size);
+static void *malloc_zpool_main(void *arg);
+static int malloc_reclaim_put(fence_t target);
+static void *malloc_reclaim_main(void *arg);
+static int malloc_par_start(unsigned threads);
+static void malloc_epoch_key_create(void);
+#endif /* PTHREAD_COMPILE != 0 */
+static void malloc_epoch_register(void);
+static void malloc_epoch_unregister(void *thread);
+static void malloc_epoch_collect(struct ethread *self);
+static void malloc_ebag_release(struct ebag *bag);
+static fnode_t malloc_list_sort(fnode_t list);
+static void malloc_release_batch(fnode_t list);
+#if PTHREAD_COMPILE != 0
+static int malloc_par_run(void *dst, const void *src, size_t n);
+static void malloc_par_parts(void);
+static void *malloc_par_main(void *arg);
+#endif /* PTHREAD_COMPILE != 0 */
+static void *malloc_tag_give(void *ptr, unsigned tag);
+static void *malloc_tag_put(void *ptr, unsigned tag, int enforce);
+static int malloc_tag_claim(unsigned tag, size_t bytes);
+static void malloc_tag_unclaim(unsigned tag, size_t bytes);
+static unsigned malloc_tag_of(void *ptr);
+static unsigned malloc_tag_take(fence_t target);
+static unsigned malloc_tag_drop(void *ptr);
+static void malloc_tag_flush(void *deltas);
+#if PTHREAD_COMPILE != 0
+static void malloc_tag_key_create(void);
+#endif /* PTHREAD_COMPILE != 0 */
+#if TCACHE_COMPILE != 0
+static int malloc_tcache_put(fence_t target, unsigned c);
+static void malloc_tcache_flush(void *cache);
+#if PTHREAD_COMPILE != 0
+static void malloc_tcache_key_create(void);
+#endif /* PTHREAD_COMPILE != 0 */
+#endif /* TCACHE_COMPILE != 0 */
+static fnode_t malloc_fnode_split(fnode_t node, size_t size);
+static void malloc_fnode_release(struct arena *arena, fence_t item);
+static size_t malloc_fnode_resize(struct arena *arena, fence_t target, size_t min, size_t max);
+static fnode_t malloc_fnode_fuse_up(struct arena *arena, fnode_t node);
+static fnode_t malloc_fnode_fuse_down(struct arena *arena, fnode_t node);
 
+static void malloc_list_insert(struct arena *arena, fnode_t item);
 static void malloc_list_addr_insert(fnode_t *list, fnode_t item);
-static void malloc_list_remove(fnode_t *list, fnode_t node);
+static void malloc_list_remove(struct arena *arena, fnode_t node);
 
 /* Debugging */
 #if DEBUG != 0
@@ -102,149 +551,2049 @@ static void malloc_print_fnode(fnode_t front);
 
 void *malloc(size_t size) 
 {
-    fnode_t fit;
-    void *ret;
-
+    if (size > SIZE_MAX / 2) {
+        errno = ENOMEM;
+        return NULL;
+    }
     /* The chunk size to be requested */
     size = ROUNDUP_CHUNK(size);
-    
+
+    if (size <= CLASS_MAX_CHUNK) {
+        return malloc_class(CLASS_OF(size));
+    }
+    return malloc_tag_give(malloc_chunk(arenas, size), tag_deltas.current);
+}
+
+void free(void* ptr) 
+{
+    fence_t target;
+    if (ptr) {
+        target = FENCE_BACKWARD(ptr);
+        /* The caches feed arena 0 and the small arena; others take theirs now */
+        if (arena_count > 1 && !malloc_arena_of(target)->cached) {
+            malloc_tag_drop(ptr);
+            malloc_release(target);
+            return;
+        }
+        malloc_tag_take(target);
+        #if TCACHE_COMPILE != 0
+        if (GETSIZE(target->size) <= CLASS_MAX_CHUNK && 
+            malloc_tcache_put(target, CLASS_OF(GETSIZE(target->size)))) {
+            return;
+        }
+        #endif /* TCACHE_COMPILE != 0 */
+        #if PTHREAD_COMPILE != 0
+        if (reclaim.threshold != 0 && GETSIZE(target->size) >= reclaim.threshold && 
+            malloc_reclaim_put(target)) {
+            return;
+        }
+        if (zpool.max != 0 && malloc_zpool_put(target)) {
+            return;
+        }
+        #endif /* PTHREAD_COMPILE != 0 */
+        malloc_release(target);
+    }
+}
+
+/* Free on the reclaimer thread, so the caller does not pay for the release. */
+void free_async(void *ptr)
+{
+    if (NULL == ptr) {
+        return;
+    }
+    malloc_tag_drop(ptr);
     #if PTHREAD_COMPILE != 0
-    pthread_mutex_lock(&mutex);
+    if (NULL == malloc_buddy_of(ptr) && malloc_reclaim_put(FENCE_BACKWARD(ptr))) {
+        return;
+    }
     #endif /* PTHREAD_COMPILE != 0 */
-    
-    if ((fit = malloc_find_fit(flist, size)) == NULL) {
-        if ((fit = malloc_expand(size)) != NULL) {
-            malloc_list_addr_insert(&flist, fit);
-        } else {
-            errno = ENOMEM;
-            #if PTHREAD_COMPILE != 0
-            pthread_mutex_unlock(&mutex);
-            #endif /* PTHREAD_COMPILE != 0 */
-            return NULL;
+    malloc_release(FENCE_BACKWARD(ptr));
+}
+
+/* Enter a read section: chunks deferred from now on outlive it. */
+void malloc_epoch_enter(void)
+{
+    if (!ethread.registered) {
+        malloc_epoch_register();
+    }
+    __atomic_store_n(&ethread.state, 
+        (__atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST) << 1) | 1, __ATOMIC_SEQ_CST);
+}
+
+void malloc_epoch_exit(void)
+{
+    __atomic_store_n(&ethread.state, ethread.state & ~(uint64_t) 1, __ATOMIC_RELEASE);
+}
+
+/* 
+ * Free 'ptr' once every read section open now has exited. Chunks are
+ * batched per thread and released together, sorted by address.
+ */
+void free_deferred(void *ptr)
+{
+    uint64_t epoch;
+    struct ebag *bag;
+    struct eblock *block;
+
+    if (NULL == ptr) {
+        return;
+    }
+    malloc_tag_drop(ptr);
+    if (!ethread.registered) {
+        malloc_epoch_register();
+    }
+    epoch = __atomic_load_n(&epoch_global, __ATOMIC_ACQUIRE);
+    bag = &ethread.bags[epoch % 3];
+    if (bag->count != 0 && bag->epoch != epoch) {
+        /* Three epochs old, so nothing can see it any more */
+        malloc_ebag_release(bag);
+    }
+    if (NULL == (block = bag->blocks) || EPOCH_BATCH == block->count) {
+        if ((block = malloc_chunk(arenas, ROUNDUP_CHUNK(sizeof(struct eblock)))) == NULL) {
+            /* 
+             * No room to defer; wait out a grace period instead, until the
+             * epoch is two past the one 'ptr' was retired in. A thread in a
+             * read section would wait on itself forever: it leaks 'ptr'.
+             */
+            if (ethread.state & 1) {
+                return;
+            }
+            while (__atomic_load_n(&epoch_global, __ATOMIC_ACQUIRE) < epoch + 2) {
+                malloc_epoch_collect(&ethread);
+                sched_yield();
+            }
+            malloc_release(FENCE_BACKWARD(ptr));
+            return;
         }
+        block->next = bag->blocks;
+        block->count = 0;
+        bag->blocks = block;
+    }
+    block->ptrs[block->count++] = ptr;
+    bag->epoch = epoch;
+    bag->count++;
+    if (++ethread.pending >= EPOCH_BATCH) {
+        ethread.pending = 0;
+        malloc_epoch_collect(&ethread);
+    }
+}
+
+/* Give a used chunk back to wherever it came from, bypassing the cache. */
+static void malloc_release(fence_t target)
+{
+    struct arena *arena = malloc_arena_of(target);
+
+    /* Buddy blocks have no header; check the arena before reading one */
+    if (arena == arenas && ISMMAPPED(target->size)) {
+        malloc_munmap(MCHUNK_OF(target + 1));
+        return;
     }
-    fit = malloc_fnode_split(&flist, fit, size);
-    malloc_list_remove(&flist, fit);
-    ret = malloc_fnode_assign_used((char*)fit, fit->size);
-    
     #if PTHREAD_COMPILE != 0
-    pthread_mutex_unlock(&mutex);
+    pthread_mutex_lock(&arena->lock);
+    #endif /* PTHREAD_COMPILE != 0 */
+    if (arena->buddy) {
+        malloc_buddy_release(arena->buddy, (char*) (target + 1));
+    } else {
+        malloc_fnode_release(arena, target);
+    }
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_unlock(&arena->lock);
     #endif /* PTHREAD_COMPILE != 0 */
-  
-    return ret;
 }
 
-void free(void* ptr) 
+/* The arena whose range holds 'chunk'; anything outside them is arena 0's. */
+static struct arena *malloc_arena_of(void *chunk)
 {
-    if (ptr) {
+    unsigned i, count = __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE);
+
+    for (i = 1; i < count; i++) {
+        if ((char*) chunk >= arenas[i].base && (char*) chunk < arenas[i].limit) {
+            return &arenas[i];
+        }
+    }
+    return arenas;
+}
+
+/* malloc from 'arena'; only arena 0 goes through the thread cache. */
+static void *malloc_arena_alloc(struct arena *arena, size_t size)
+{
+    if (arena == arenas) {
+        return malloc(size);
+    }
+    if (arena->buddy) {
+        return malloc_buddy_alloc(arena, size);
+    }
+    if (size > SIZE_MAX / 2) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return malloc_chunk(arena, ROUNDUP_CHUNK(size));
+}
+
+/* Add an arena over a fresh reserved range. Call with arenas_mutex held. */
+static int malloc_arena_add(char cached, int type, const struct memreq_backend *backend)
+{
+    struct arena *arena;
+    struct buddy *buddy = NULL;
+    size_t reserved = ARENA_RESERVE;
+    char *base, *heap;
+
+    if (arena_count >= ARENA_MAX || (base = backend->reserve(backend->data, &reserved)) == NULL) {
+        return -1;
+    }
+    if (MALLOC_ARENA_BUDDY == type) {
+        /* Bookkeeping first, then the first size-aligned span after it */
+        heap = (char*) ROUNDUP_ALIGN((uintptr_t) base + sizeof(struct buddy), BUDDY_SPAN);
+        if (heap + BUDDY_SPAN > base + reserved || 
+            backend->commit(backend->data, base, sizeof(struct buddy)) != 0 || 
+            backend->commit(backend->data, heap, BUDDY_SPAN) != 0) {
+            backend->release(backend->data, base, reserved);
+            return -1;
+        }
+        buddy = (struct buddy*) base;
+        buddy->heap = heap;
+        buddy->lists[BUDDY_ORDERS - 1] = (fnode_t) heap;
+    }
+    arena = &arenas[arena_count];
+    arena->buddy = buddy;
+    arena->base = base;
+    arena->limit = base + reserved;
+    arena->backend = backend;
+    arena->cached = cached;
+    arena->order = free_order;
+    arena->fit = fit_policy;
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_init(&arena->lock, NULL);
+    #endif /* PTHREAD_COMPILE != 0 */
+    /* Lookups read the count without the lock; publish the arena first */
+    __atomic_store_n(&arena_count, arena_count + 1, __ATOMIC_RELEASE);
+    return arena - arenas;
+}
+
+/* Set one arena's tunables; the parameters are mallopt's. */
+int malloc_arena_opt(int index, int param, int value)
+{
+    struct arena *arena;
+    fnode_t node, prev = NULL;
+
+    if (index < 0 || (unsigned) index >= __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    if (!(M_FREE_ORDER == param && (MALLOC_ORDER_ADDRESS == value || MALLOC_ORDER_LIFO == value)) && 
+        !(M_PLACEMENT == param && value >= 0 && value < MALLOC_FIT_COUNT)) {
+        return 0;
+    }
+    arena = &arenas[index];
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_lock(&arena->lock);
+    #endif /* PTHREAD_COMPILE != 0 */
+    if (M_PLACEMENT == param) {
+        arena->fit = value;
+    } else {
+        if (MALLOC_ORDER_ADDRESS == value && arena->order != value) {
+            /* Put the list back in address order and relink the prev pointers */
+            arena->flist = malloc_list_sort(arena->flist);
+            for (node = arena->flist; node != NULL; prev = node, node = node->next) {
+                node->prev = prev;
+            }
+        }
+        arena->order = value;
+    }
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_unlock(&arena->lock);
+    #endif /* PTHREAD_COMPILE != 0 */
+    return 1;
+}
+
+void malloc_get_stats(struct malloc_stats *stats)
+{
+    unsigned i, count = __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE);
+    int f;
+
+    *stats = (struct malloc_stats) { 0 };
+    /* Other threads' deltas are not seen until they pass the slack */
+    malloc_tag_flush(&tag_deltas);
+    for (f = 0; f < MALLOC_TAG_COUNT; f++) {
+        stats->tags[f].bytes = __atomic_load_n(&tag_totals[f].bytes, __ATOMIC_RELAXED);
+        stats->tags[f].blocks = __atomic_load_n(&tag_totals[f].blocks, __ATOMIC_RELAXED);
+        /* Frees counted before the allocations they undo */
+        if ((long) stats->tags[f].bytes < 0 || (long) stats->tags[f].blocks < 0) {
+            stats->tags[f] = (struct malloc_tag_stats) { 0 };
+        }
+    }
+    for (i = 0; i < count; i++) {
         #if PTHREAD_COMPILE != 0
-        pthread_mutex_lock(&mutex);
+        pthread_mutex_lock(&arenas[i].lock);
         #endif /* PTHREAD_COMPILE != 0 */
-        malloc_fnode_release(&flist, FENCE_BACKWARD(ptr));
+        for (f = 0; f < MALLOC_FIT_COUNT; f++) {
+            stats->fit[f].searches += arenas[i].stats[f].searches;
+            stats->fit[f].visited += arenas[i].stats[f].visited;
+            stats->fit[f].misses += arenas[i].stats[f].misses;
+        }
         #if PTHREAD_COMPILE != 0
-        pthread_mutex_unlock(&mutex);
+        pthread_mutex_unlock(&arenas[i].lock);
         #endif /* PTHREAD_COMPILE != 0 */
     }
 }
 
-/* Find the first fit that can fit in size + new node overhead */
-static fnode_t malloc_find_fit(fnode_t target, size_t size) 
+/* 
+ * Give back the top of a reserved arena past 'pad' free bytes, and purge
+ * the whole pages inside its other free chunks. Called with its lock held.
+ */
+static int malloc_arena_trim(struct arena *arena, size_t pad)
 {
-    while (target != NULL) {
-        if (target->size >= size) {
-            return target;
-        } else {
-            target = target->next;
+    const struct memreq_backend *backend = arena->backend;
+    fence_t last;
+    fnode_t node;
+    char *from, *to;
+    int ret = 0;
+
+    if (NULL == arena->brk || arena->buddy) {
+        return 0;
+    }
+    /* The chunk under the end fence; the break is not the arena's to lower */
+    last = FENCE_BACKWARD(arena->brk) - 1;
+    if (arena->base != NULL && !ISUSED(last->size)) {
+        node = (fnode_t) ((char*) (last + 1) - GETSIZE(last->size));
+        to = (char*) ROUNDUP_PAGE((uintptr_t) node + NODE_OVERHEAD + pad + FENCE_SIZE);
+        if (to < arena->brk && backend->decommit(backend->data, to, arena->brk - to) == 0) {
+            malloc_list_remove(arena, node);
+            malloc_list_insert(arena, malloc_fnode_assign_free((char*) node, to - FENCE_SIZE - (char*) node));
+            FENCE_BACKWARD(to)->size = 1;
+            __atomic_sub_fetch(&footprint, arena->brk - to, __ATOMIC_RELAXED);
+            arena->brk = to;
+            ret = 1;
+        }
+    }
+    for (node = arena->flist; node != NULL; node = node->next) {
+        from = (char*) ROUNDUP_PAGE((uintptr_t) (node + 1));
+        to = (char*) ROUNDDOWN_PAGE((uintptr_t) node + GETSIZE(node->size) - FENCE_SIZE);
+        if (from < to) {
+            backend->purge(backend->data, from, to - from);
+            ret = 1;
         }
     }
-    return target;
+    return ret;
 }
 
-/* Initialize and fence a free node. */
-static fnode_t malloc_fnode_assign_free(char *start, size_t size) 
+int malloc_trim(size_t pad)
 {
-    fnode_t node = (fnode_t) start;
-    fence_t end = FENCE_BACKWARD(start + size);
-    node->size = size;
-    SET_FREE(node->size);
-    end->size = node->size;
-    node->prev = NULL;
-    node->next = NULL;
-    
-    return node;
+    unsigned i, count = __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE);
+    int ret = 0;
+
+    for (i = 0; i < count; i++) {
+        #if PTHREAD_COMPILE != 0
+        pthread_mutex_lock(&arenas[i].lock);
+        #endif /* PTHREAD_COMPILE != 0 */
+        ret |= malloc_arena_trim(&arenas[i], pad);
+        #if PTHREAD_COMPILE != 0
+        pthread_mutex_unlock(&arenas[i].lock);
+        #endif /* PTHREAD_COMPILE != 0 */
+    }
+    return ret;
 }
 
-/* Prepare node to be returned to the user. */
-static void *malloc_fnode_assign_used(char *start, size_t size)
+int malloc_arena_create(void)
 {
-    fnode_t node = (fnode_t) start;
-    fence_t end = FENCE_BACKWARD((start + size));
-    node->size = size;
-    SET_USED(node->size);
-    end->size = node->size;
-    node->prev = NULL;
-    node->next = NULL;
- 
-    return start + FENCE_SIZE;
+    return malloc_arena_create_type(MALLOC_ARENA_FIRST_FIT);
+}
+
+int malloc_arena_create_type(int type)
+{
+    return malloc_arena_create_backend(type, &memreq_mmap);
+}
+
+int malloc_arena_create_backend(int type, const struct memreq_backend *backend)
+{
+    int ret = -1;
+
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_lock(&arenas_mutex);
+    #endif /* PTHREAD_COMPILE != 0 */
+    if (MALLOC_ARENA_FIRST_FIT == type || MALLOC_ARENA_BUDDY == type) {
+        ret = malloc_arena_add(0, type, backend);
+    }
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_unlock(&arenas_mutex);
+    #endif /* PTHREAD_COMPILE != 0 */
+    return ret;
+}
+
+/* The buddy arena holding 'ptr', or NULL if it is a chunk with a header. */
+static struct buddy *malloc_buddy_of(void *ptr)
+{
+    if (__atomic_load_n(&arena_count, __ATOMIC_RELAXED) <= 1) {
+        return NULL;
+    }
+    return malloc_arena_of(ptr)->buddy;
+}
+
+/* Toggle the pair bit of 'block' at order 'k'; returns the new value. */
+static int malloc_buddy_flip(struct buddy *buddy, char *block, unsigned k)
+{
+    size_t bit = BUDDY_BLOCKS - (BUDDY_BLOCKS >> k) + 
+        ((size_t) (block - buddy->heap) >> (BUDDY_MIN_SHIFT + k + 1));
+    buddy->pairs[bit / 8] ^= 1 << (bit % 8);
+    return (buddy->pairs[bit / 8] >> (bit % 8)) & 1;
+}
+
+static void malloc_buddy_push(struct buddy *buddy, char *block, unsigned k)
+{
+    fnode_t node = (fnode_t) block;
+    node->size = BUDDY_MIN << k;
+    node->prev = NULL;
+    if ((node->next = buddy->lists[k])) {
+        node->next->prev = node;
+    }
+    buddy->lists[k] = node;
+}
+
+static void malloc_buddy_unlink(struct buddy *buddy, fnode_t node, unsigned k)
+{
+    if (node->prev) {
+        node->prev->next = node->next;
+    } else {
+        buddy->lists[k] = node->next;
+    }
+    if (node->next) {
+        node->next->prev = node->prev;
+    }
+}
+
+/* 
+ * Take the smallest free block of at least 'size', splitting larger ones
+ * down and freeing the upper halves on the way.
+ */
+static void *malloc_buddy_alloc(struct arena *arena, size_t size)
+{
+    struct buddy *buddy = arena->buddy;
+    unsigned order = 0, k;
+    fnode_t block;
+
+    while ((BUDDY_MIN << order) < size) {
+        if (++order == BUDDY_ORDERS) {
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_lock(&arena->lock);
+    #endif /* PTHREAD_COMPILE != 0 */
+    for (k = order; k < BUDDY_ORDERS && NULL == buddy->lists[k]; k++);
+    if (BUDDY_ORDERS == k) {
+        #if PTHREAD_COMPILE != 0
+        pthread_mutex_unlock(&arena->lock);
+        #endif /* PTHREAD_COMPILE != 0 */
+        errno = ENOMEM;
+        return NULL;
+    }
+    block = buddy->lists[k];
+    malloc_buddy_unlink(buddy, block, k);
+    if (k < BUDDY_ORDERS - 1) {
+        malloc_buddy_flip(buddy, (char*) block, k);
+    }
+    while (k-- > order) {
+        malloc_buddy_push(buddy, (char*) block + (BUDDY_MIN << k), k);
+        malloc_buddy_flip(buddy, (char*) block, k);
+    }
+    buddy->orders[((char*) block - buddy->heap) >> BUDDY_MIN_SHIFT] = order + 1;
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_unlock(&arena->lock);
+    #endif /* PTHREAD_COMPILE != 0 */
+    return block;
+}
+
+/* Free a block, merging with its buddy for as long as that is free. */
+static void malloc_buddy_release(struct buddy *buddy, char *block)
+{
+    size_t index = (block - buddy->heap) >> BUDDY_MIN_SHIFT;
+    unsigned k = buddy->orders[index] - 1;
+    char *other;
+
+    buddy->orders[index] = 0;
+    while (k < BUDDY_ORDERS - 1 && 0 == malloc_buddy_flip(buddy, block, k)) {
+        other = buddy->heap + ((block - buddy->heap) ^ (BUDDY_MIN << k));
+        malloc_buddy_unlink(buddy, (fnode_t) other, k);
+        block = MIN(block, other);
+        k++;
+    }
+    malloc_buddy_push(buddy, block, k);
+}
+
+static size_t malloc_buddy_size(struct buddy *buddy, char *block)
+{
+    return BUDDY_MIN << (buddy->orders[(block - buddy->heap) >> BUDDY_MIN_SHIFT] - 1);
+}
+
+/* 
+ * Keep blocks of one expected lifetime together, so long-lived ones do not
+ * pin pages that short-lived ones leave full of holes. Each lifetime gets
+ * an arena the first time it is asked for; without one, this is malloc.
+ */
+void *malloc_hint(size_t size, int lifetime)
+{
+    struct arena *arena;
+    void *ret;
+
+    if (lifetime != MALLOC_SHORT_LIVED && lifetime != MALLOC_LONG_LIVED) {
+        return malloc(size);
+    }
+    arena = malloc_arena_lazy(&lifetime_arenas[lifetime - 1], 0);
+    /* Out of arenas, or the arena's range is full */
+    if (NULL == arena || (ret = malloc_arena_alloc(arena, size)) == NULL) {
+        return malloc(size);
+    }
+    return malloc_tag_give(ret, tag_deltas.current);
+}
+
+/* The arena in '*slot', made the first time; NULL if it cannot be made. */
+static struct arena *malloc_arena_lazy(int *slot, char cached)
+{
+    int index;
+
+    if ((index = __atomic_load_n(slot, __ATOMIC_ACQUIRE)) == 0) {
+        #if PTHREAD_COMPILE != 0
+        pthread_mutex_lock(&arenas_mutex);
+        #endif /* PTHREAD_COMPILE != 0 */
+        if ((index = *slot) == 0) {
+            index = malloc_arena_add(cached, MALLOC_ARENA_FIRST_FIT, &memreq_mmap);
+            __atomic_store_n(slot, index, __ATOMIC_RELEASE);
+        }
+        #if PTHREAD_COMPILE != 0
+        pthread_mutex_unlock(&arenas_mutex);
+        #endif /* PTHREAD_COMPILE != 0 */
+    }
+    return index > 0 ? &arenas[index] : NULL;
+}
+
+/* 
+ * Carve a chunk of 'size' where it lives: size classes in their own region,
+ * larger chunks in the sbrk heap (the largest are mapped on their own).
+ * Once the small arena's range is full, size classes spill into arena 0.
+ */
+static void *malloc_size_chunk(size_t size)
+{
+    struct arena *arena;
+    void *ret;
+
+    if (size <= CLASS_MAX_CHUNK && (arena = malloc_arena_lazy(&small_arena, 1)) != NULL && 
+        (ret = malloc_chunk(arena, size)) != NULL) {
+        return ret;
+    }
+    return malloc_chunk(arenas, size);
+}
+
+/* Take a chunk of class 'c' from this thread's cache, or from the heap. */
+void *malloc_class(unsigned c)
+{
+    #if TCACHE_COMPILE != 0
+    fnode_t node;
+    #endif /* TCACHE_COMPILE != 0 */
+
+    if (c >= MALLOC_CLASS_COUNT) {
+        errno = EINVAL;
+        return NULL;
+    }
+    #if TCACHE_COMPILE != 0
+    if ((node = tcache.bins[c]) != NULL) {
+        tcache.bins[c] = node->next;
+        tcache.counts[c]--;
+        return malloc_tag_give((char*) node + FENCE_SIZE, tag_deltas.current);
+    }
+    #endif /* TCACHE_COMPILE != 0 */
+    return malloc_tag_give(malloc_size_chunk(CLASS_CHUNK(c)), tag_deltas.current);
+}
+
+/* Free a chunk the caller knows is of class 'c' without reading its header. */
+void free_class(void *ptr, unsigned c)
+{
+    if (NULL == ptr) {
+        return;
+    }
+    assert(c < MALLOC_CLASS_COUNT && 
+        CLASS_CHUNK(c) <= GETSIZE(FENCE_BACKWARD(ptr)->size));
+    malloc_tag_take(FENCE_BACKWARD(ptr));
+    #if TCACHE_COMPILE != 0
+    if (malloc_tcache_put(FENCE_BACKWARD(ptr), c)) {
+        return;
+    }
+    #endif /* TCACHE_COMPILE != 0 */
+    malloc_release(FENCE_BACKWARD(ptr));
+}
+
+/* 
+ * Carve a chunk of exactly 'size' (already rounded) out of the heap, or map
+ * it on its own if it is large.
+ */
+static void *malloc_chunk(struct arena *arena, size_t size)
+{
+    fnode_t fit;
+    void *ret;
+
+    if (size >= mmap_threshold && ARENA_MAPS_LARGE(arena)) {
+        return malloc_mmap(size, 0);
+    }
+
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_lock(&arena->lock);
+    #endif /* PTHREAD_COMPILE != 0 */
+    
+    if ((fit = malloc_find_fit(arena, size)) == NULL) {
+        if ((fit = malloc_expand(arena, size)) != NULL) {
+            malloc_list_insert(arena, fit);
+        } else {
+            errno = ENOMEM;
+            #if PTHREAD_COMPILE != 0
+            pthread_mutex_unlock(&arena->lock);
+            #endif /* PTHREAD_COMPILE != 0 */
+            return NULL;
+        }
+    }
+    fit = malloc_fnode_split(fit, size);
+    malloc_list_remove(arena, fit);
+    ret = malloc_fnode_assign_used((char*)fit, fit->size);
+    
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_unlock(&arena->lock);
+    #endif /* PTHREAD_COMPILE != 0 */
+  
+    return ret;
+}
+
+#if TCACHE_COMPILE != 0
+/* Push a used chunk onto this thread's cache. Returns 0 if the bin is full. */
+static int malloc_tcache_put(fence_t target, unsigned c)
+{
+    fnode_t node = (fnode_t) target;
+    if (tcache.counts[c] >= TCACHE_COUNT) {
+        return 0;
+    }
+    #if PTHREAD_COMPILE != 0
+    if (!tcache.registered) {
+        pthread_once(&tcache_once, malloc_tcache_key_create);
+        pthread_setspecific(tcache_key, &tcache);
+        tcache.registered = 1;
+    }
+    #endif /* PTHREAD_COMPILE != 0 */
+    node->next = tcache.bins[c];
+    tcache.bins[c] = node;
+    tcache.counts[c]++;
+    return 1;
+}
+
+/* Return every cached chunk to the heap. Runs at thread exit. */
+static void malloc_tcache_flush(void *cache)
+{
+    struct tcache *tc = cache;
+    fnode_t node, next, list = NULL;
+    unsigned c;
+
+    /* Cached chunks can come from two arenas; the batch sorts that out */
+    for (c = 0; c < MALLOC_CLASS_COUNT; c++) {
+        for (node = tc->bins[c]; node != NULL; node = next) {
+            next = node->next;
+            node->next = list;
+            list = node;
+        }
+        tc->bins[c] = NULL;
+        tc->counts[c] = 0;
+    }
+    malloc_release_batch(list);
+    /* Frees made by later destructors will register the cache again */
+    tc->registered = 0;
+}
+
+#if PTHREAD_COMPILE != 0
+static void malloc_tcache_key_create(void)
+{
+    pthread_key_create(&tcache_key, malloc_tcache_flush);
+}
+#endif /* PTHREAD_COMPILE != 0 */
+#endif /* TCACHE_COMPILE != 0 */
+
+/* Fold this thread's counts for 'tag' into the totals. */
+static void malloc_tag_fold(struct tag_deltas *td, unsigned tag)
+{
+    __atomic_add_fetch(&tag_totals[tag].bytes, (size_t) td->bytes[tag], __ATOMIC_RELAXED);
+    __atomic_add_fetch(&tag_totals[tag].blocks, (size_t) td->blocks[tag], __ATOMIC_RELAXED);
+    td->bytes[tag] = 0;
+    td->blocks[tag] = 0;
+}
+
+static void malloc_tag_count(unsigned tag, long bytes, long blocks)
+{
+    struct tag_deltas *td = &tag_deltas;
+
+    #if PTHREAD_COMPILE != 0
+    if (!td->registered) {
+        pthread_once(&tag_once, malloc_tag_key_create);
+        pthread_setspecific(tag_key, td);
+        td->registered = 1;
+    }
+    #endif /* PTHREAD_COMPILE != 0 */
+    td->bytes[tag] += bytes;
+    td->blocks[tag] += blocks;
+    if (tag_limits[tag].soft != 0 || tag_limits[tag].hard != 0 || 
+        td->bytes[tag] >= TAG_SLACK_BYTES || td->bytes[tag] <= -TAG_SLACK_BYTES || 
+        td->blocks[tag] >= TAG_SLACK_BLOCKS || td->blocks[tag] <= -TAG_SLACK_BLOCKS) {
+        malloc_tag_fold(td, tag);
+    }
+}
+
+/* 
+ * Count a new block of 'bytes' under 'tag', calling the hook if that takes
+ * the tag over its soft limit. 0 if it would pass the hard limit and
+ * 'enforce' is set; nothing is counted then.
+ */
+static int malloc_tag_charge(unsigned tag, size_t bytes, long blocks, int enforce)
+{
+    struct tag_limit *limit = &tag_limits[tag];
+    size_t soft = __atomic_load_n(&limit->soft, __ATOMIC_RELAXED);
+    size_t hard = __atomic_load_n(&limit->hard, __ATOMIC_RELAXED);
+    size_t now;
+
+    if (0 == soft && 0 == hard) {
+        malloc_tag_count(tag, bytes, blocks);
+        return 1;
+    }
+    /* Check and add in one step, so threads racing for the last bytes cannot both win */
+    now = __atomic_load_n(&tag_totals[tag].bytes, __ATOMIC_RELAXED);
+    do {
+        if (enforce && hard != 0 && now + bytes > hard) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&tag_totals[tag].bytes, &now, now + bytes, 1, 
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    __atomic_add_fetch(&tag_totals[tag].blocks, (size_t) blocks, __ATOMIC_RELAXED);
+    if (soft != 0 && now + bytes > soft && now <= soft && limit->hook != NULL) {
+        limit->hook(tag, now + bytes, limit->arg);
+    }
+    return 1;
+}
+
+/* 
+ * Reserve 'bytes' under 'tag' for a block about to grow by that much, so
+ * the growth cannot pass the hard limit. 0 if it would.
+ */
+static int malloc_tag_claim(unsigned tag, size_t bytes)
+{
+    return 0 == tag || malloc_tag_charge(tag, bytes, 0, 1);
+}
+
+/* Give a reservation back, once the grown block is counted or failed to grow. */
+static void malloc_tag_unclaim(unsigned tag, size_t bytes)
+{
+    if (tag != 0) {
+        malloc_tag_count(tag, -(long) bytes, 0);
+    }
+}
+
+static unsigned malloc_tag_of(void *ptr)
+{
+    return NULL == malloc_buddy_of(ptr) ? GETTAG(FENCE_BACKWARD(ptr)->size) : 0;
+}
+
+/* 
+ * Mark the block at 'ptr' with 'tag' and count it, unless it has a tag
+ * already. Past the tag's hard limit, with 'enforce' set, the block is
+ * freed and NULL returned with ENOMEM.
+ */
+static void *malloc_tag_put(void *ptr, unsigned tag, int enforce)
+{
+    fence_t target;
+
+    if (0 == tag || NULL == ptr || malloc_buddy_of(ptr) != NULL) {
+        return ptr;
+    }
+    target = FENCE_BACKWARD(ptr);
+    if (0 == GETTAG(target->size)) {
+        if (!malloc_tag_charge(tag, GETSIZE(target->size) - FENCE_OVERHEAD, 1, enforce)) {
+            malloc_release(target);
+            errno = ENOMEM;
+            return NULL;
+        }
+        target->size |= (size_t) tag << TAG_SHIFT;
+    }
+    return ptr;
+}
+
+/* Tag a block just allocated, within the tag's hard limit. */
+static void *malloc_tag_give(void *ptr, unsigned tag)
+{
+    return malloc_tag_put(ptr, tag, 1);
+}
+
+/* Clear the tag of a chunk about to be freed or resized; returns it. */
+static unsigned malloc_tag_take(fence_t target)
+{
+    unsigned tag = GETTAG(target->size);
+
+    if (tag != 0) {
+        target->size &= ~TAG_MASK;
+        malloc_tag_count(tag, -(long) (GETSIZE(target->size) - FENCE_OVERHEAD), -1);
+    }
+    return tag;
+}
+
+/* The same for a block that may be from a buddy arena, which has no header. */
+static unsigned malloc_tag_drop(void *ptr)
+{
+    return NULL == malloc_buddy_of(ptr) ? malloc_tag_take(FENCE_BACKWARD(ptr)) : 0;
+}
+
+/* Fold all of a thread's counts in. Runs at thread exit and for stats. */
+static void malloc_tag_flush(void *deltas)
+{
+    struct tag_deltas *td = deltas;
+    unsigned tag;
+
+    for (tag = 1; tag < MALLOC_TAG_COUNT; tag++) {
+        if (td->bytes[tag] != 0 || td->blocks[tag] != 0) {
+            malloc_tag_fold(td, tag);
+        }
+    }
+    /* Frees made by later destructors will register the deltas again */
+    td->registered = 0;
+}
+
+#if PTHREAD_COMPILE != 0
+static void malloc_tag_key_create(void)
+{
+    pthread_key_create(&tag_key, malloc_tag_flush);
+}
+#endif /* PTHREAD_COMPILE != 0 */
+
+int malloc_set_tag(unsigned tag)
+{
+    unsigned previous = tag_deltas.current;
+
+    if (tag >= MALLOC_TAG_COUNT) {
+        errno = EINVAL;
+        return -1;
+    }
+    tag_deltas.current = tag;
+    return previous;
+}
+
+int malloc_tag_limit(unsigned tag, size_t soft, size_t hard, malloc_tag_hook_t hook, void *arg)
+{
+    struct tag_limit *limit;
+
+    if (0 == tag || tag >= MALLOC_TAG_COUNT || (hard != 0 && soft > hard)) {
+        errno = EINVAL;
+        return -1;
+    }
+    limit = &tag_limits[tag];
+    /* The hook is in place before the limit that calls it */
+    limit->arg = arg;
+    __atomic_store_n(&limit->hook, hook, __ATOMIC_RELEASE);
+    __atomic_store_n(&limit->soft, soft, __ATOMIC_RELAXED);
+    __atomic_store_n(&limit->hard, hard, __ATOMIC_RELAXED);
+    /* From now on this thread counts the tag straight into the totals */
+    malloc_tag_fold(&tag_deltas, tag);
+    return 0;
+}
+
+void *malloc_tagged(size_t size, unsigned tag)
+{
+    unsigned previous = tag_deltas.current;
+    void *ret;
+
+    if (tag >= MALLOC_TAG_COUNT) {
+        errno = EINVAL;
+        return NULL;
+    }
+    tag_deltas.current = tag;
+    ret = malloc(size);
+    tag_deltas.current = previous;
+    return ret;
+}
+
+/* 
+ * The size is already recorded in the chunk header, so sized free only
+ * checks the caller's claim before taking the normal release path.
+ */
+void free_sized(void *ptr, size_t size)
+{
+    assert(NULL == ptr || size <= malloc_usable_size(ptr));
+    free(ptr);
+}
+
+void free_aligned_sized(void *ptr, size_t alignment, size_t size)
+{
+    assert(NULL == ptr || 0 == ((uintptr_t) ptr & (alignment - 1)));
+    free_sized(ptr, size);
+}
+
+/* 
+ * A chunk is never handed out smaller than ROUNDUP_CHUNK; aligned requests
+ * split their lead off, so alignment does not change the usable size. The
+ * result is a lower bound for mappings reused from the cache.
+ */
+size_t nallocx(size_t size, int flags)
+{
+    size_t alignment = (size_t) 1 << (flags & MALLOCX_ALIGN_MASK);
+    size_t block = BUDDY_MIN, header;
+    if (size > SIZE_MAX / 2 || alignment > SIZE_MAX / 4) {
+        return 0;
+    }
+    if ((flags & MALLOCX_ARENA_MASK) && malloc_flags_valid(flags) && 
+        arenas[FLAGS_ARENA(flags)].buddy) {
+        while (block < MAX(size, alignment) && block < BUDDY_SPAN) {
+            block <<= 1;
+        }
+        return block >= MAX(size, alignment) ? block : 0;
+    }
+    size = ROUNDUP_CHUNK(size);
+    if (size >= mmap_threshold && (!(flags & MALLOCX_ARENA_MASK) || !malloc_flags_valid(flags) || 
+        ARENA_MAPS_LARGE(&arenas[FLAGS_ARENA(flags)]))) {
+        /* Mappings get the rest of their last page */
+        if (0 == PAGE_SIZE) {
+            PAGE_SIZE = sysconf(_SC_PAGESIZE);
+        }
+        header = malloc_mmap_header(size, FLAGS_ALIGNMENT(flags));
+        return ROUNDUP_PAGE(header + size - FENCE_OVERHEAD) - header;
+    }
+    return size - FENCE_OVERHEAD;
+}
+
+size_t malloc_good_size(size_t size)
+{
+    return nallocx(size, 0);
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+    struct buddy *buddy;
+
+    if (NULL == ptr) {
+        return 0;
+    }
+    if ((buddy = malloc_buddy_of(ptr)) != NULL) {
+        return malloc_buddy_size(buddy, ptr);
+    }
+    return GETSIZE(FENCE_BACKWARD(ptr)->size) - FENCE_OVERHEAD;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (!ISPOW2(alignment)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return malloc_tag_give(malloc_aligned(arenas, alignment, size), tag_deltas.current);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *ret;
+    if (!ISPOW2(alignment) || alignment % sizeof(void*) != 0) {
+        return EINVAL;
+    }
+    if ((ret = malloc_tag_give(malloc_aligned(arenas, alignment, size), tag_deltas.current)) == NULL) {
+        return ENOMEM;
+    }
+    *memptr = ret;
+    return 0;
+}
+
+/* 
+ * Find a chunk with room for an aligned user pointer plus a leading free
+ * node, split the lead off and hand out the rest like malloc does.
+ */
+static void *malloc_aligned(struct arena *arena, size_t alignment, size_t size)
+{
+    fnode_t fit;
+    char *user;
+    size_t lead, search;
+    void *ret;
+
+    if (size > SIZE_MAX / 2 || alignment > SIZE_MAX / 4) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (alignment <= ALIGN_SIZE || arena->buddy) {
+        return malloc_arena_alloc(arena, MAX(size, alignment));
+    }
+    size = ROUNDUP_CHUNK(size);
+    if (size >= mmap_threshold && ARENA_MAPS_LARGE(arena)) {
+        return malloc_mmap(size, alignment);
+    }
+    search = size + alignment + NODE_OVERHEAD;
+
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_lock(&arena->lock);
+    #endif /* PTHREAD_COMPILE != 0 */
+
+    if ((fit = malloc_find_fit(arena, search)) == NULL) {
+        if ((fit = malloc_expand(arena, search)) != NULL) {
+            malloc_list_insert(arena, fit);
+        } else {
+            errno = ENOMEM;
+            #if PTHREAD_COMPILE != 0
+            pthread_mutex_unlock(&arena->lock);
+            #endif /* PTHREAD_COMPILE != 0 */
+            return NULL;
+        }
+    }
+    
+    /* The lead is either empty or big enough to stand as a free node */
+    user = (char*) ROUNDUP_ALIGN((uintptr_t) fit + FENCE_SIZE, alignment);
+    lead = user - FENCE_SIZE - (char*) fit;
+    while (lead != 0 && lead < NODE_OVERHEAD) {
+        user += alignment;
+        lead += alignment;
+    }
+    if (lead != 0) {
+        malloc_fnode_split(fit, lead);
+        fit = (fnode_t) (user - FENCE_SIZE);
+    }
+    fit = malloc_fnode_split(fit, size);
+    malloc_list_remove(arena, fit);
+    ret = malloc_fnode_assign_used((char*)fit, fit->size);
+
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_unlock(&arena->lock);
+    #endif /* PTHREAD_COMPILE != 0 */
+
+    return ret;
+}
+
+/* 
+ * Find a free node of at least 'size' the way the arena's placement says,
+ * counting the nodes looked at:
+ *  first - the first one in the list
+ *  next  - the first one from where the last search stopped, wrapping once
+ *  best  - the smallest one; stops early on an exact fit
+ *  good  - the smallest of the first good_fit_count that fit
+ */
+static fnode_t malloc_find_fit(struct arena *arena, size_t size) 
+{
+    struct malloc_fit_stats *stats = &arena->stats[(int) arena->fit];
+    fnode_t target, start, fit = NULL;
+    unsigned fits = 0;
+    size_t visited = 0;
+
+    switch (arena->fit) {
+    case MALLOC_FIT_NEXT:
+        start = arena->rover ? arena->rover : arena->flist;
+        for (target = start; target != NULL && NULL == fit; target = target->next) {
+            visited++;
+            fit = target->size >= size ? target : NULL;
+        }
+        for (target = arena->flist; target != start && NULL == fit; target = target->next) {
+            visited++;
+            fit = target->size >= size ? target : NULL;
+        }
+        arena->rover = fit;
+        break;
+    case MALLOC_FIT_BEST:
+    case MALLOC_FIT_GOOD:
+        for (target = arena->flist; target != NULL; target = target->next) {
+            visited++;
+            if (target->size < size) {
+                continue;
+            }
+            if (NULL == fit || target->size < fit->size) {
+                fit = target;
+            }
+            if (target->size == size || 
+                (MALLOC_FIT_GOOD == arena->fit && ++fits >= good_fit_count)) {
+                break;
+            }
+        }
+        break;
+    default:
+        for (target = arena->flist; target != NULL && NULL == fit; target = target->next) {
+            visited++;
+            fit = target->size >= size ? target : NULL;
+        }
+    }
+    stats->searches++;
+    stats->visited += visited;
+    stats->misses += NULL == fit;
+    return fit;
+}
+
+/* Initialize and fence a free node. */
+static fnode_t malloc_fnode_assign_free(char *start, size_t size) 
+{
+    fnode_t node = (fnode_t) start;
+    fence_t end = FENCE_BACKWARD(start + size);
+    node->size = size;
+    SET_FREE(node->size);
+    end->size = node->size;
+    node->prev = NULL;
+    node->next = NULL;
+    
+    return node;
+}
+
+/* Prepare node to be returned to the user. */
+static void *malloc_fnode_assign_used(char *start, size_t size)
+{
+    fnode_t node = (fnode_t) start;
+    fence_t end = FENCE_BACKWARD((start + size));
+    node->size = size;
+    SET_USED(node->size);
+    end->size = node->size;
+    node->prev = NULL;
+    node->next = NULL;
+ 
+    return start + FENCE_SIZE;
+}
+
+/* Re-fence a used chunk at a new size, leaving its contents alone. */
+static void malloc_fnode_set_used(fence_t target, size_t size)
+{
+    target->size = size;
+    SET_USED(target->size);
+    FENCE_BACKWARD((char*) target + size)->size = target->size;
+}
+
+/* Increase the arena's break, return a free node at the new break. */
+static fnode_t malloc_expand(struct arena *arena, size_t size)
+{
+    char *start, *end;
+    char init = 0;
+    if (0 == size)
+        return NULL;
+    /* Initialize if first time running malloc */
+    if (0 == PAGE_SIZE) {
+        PAGE_SIZE = sysconf(_SC_PAGESIZE);
+    }
+    if (NULL == arena->start) {
+        init = 1;
+        size = ROUNDUP_PAGE(size + FENCE_OVERHEAD);
+    } else {
+        size = ROUNDUP_PAGE(size);
+    }
+    if (arena->base != NULL) {
+        /* Commit the next pages of the reserved range */
+        start = arena->brk ? arena->brk : arena->base;
+        if (size > (size_t) (arena->limit - start) || 
+            arena->backend->commit(arena->backend->data, start, size) != 0) {
+            return NULL;
+        }
+        end = start + size;
+    } else {
+        /* get_memory takes an unsigned; do not let the request wrap */
+        if (size > UINT_MAX || (start = get_memory(size)) == NULL) {
+            return NULL;
+        }
+        /* Not get_memory(0): an sbrk arena may have moved the break since */
+        end = start + size;
+    }
+    __atomic_add_fetch(&footprint, end - start, __ATOMIC_RELAXED);
+    if (1 == init) {
+        arena->start = start;
+    }
+    
+    /* Two cases; getting an isolated chunk or a neighboring chunk */
+    
+    /* Fence the higher end of the allocated chunk */
+    FENCE_BACKWARD(end)->size = 1;
+    size = end - start;
+    if (arena->brk != start) {
+        /* Fence the lower end */
+        ((fence_t) start)->size = 1;
+        start += FENCE_SIZE;
+        size -= 2 * FENCE_SIZE;
+    } else {
+        /* Absorb the previous fence */
+        start -= FENCE_SIZE;
+    }
+    arena->brk = end;
+    
+    #if DEBUG != 0
+    //~ printf("Current number of pages: %ld\n", (arenas->brk - arenas->start) / PAGE_SIZE);
+    //~ printf("Current fence value at the end: %ld\n", FENCE_BACKWARD(arenas->brk)->size);
+    //~ printf("Current recorded break: %p\n", arenas->brk);
+    //~ printf("Current actual break: %p\n", sbrk(0));
+
+    //~ if ((arenas->brk - arenas->start) / PAGE_SIZE >= 9) {
+        //~ printf("Current fence value at 9th page: %ld\n", FENCE_BACKWARD(arenas->start + 9 * PAGE_SIZE)->size);
+    //~ }
+    //~ if ((arenas->brk - arenas->start) / PAGE_SIZE >= 10) {
+        //~ printf("Current fence value at 10th page: %ld\n", FENCE_BACKWARD(arenas->start + 10 * PAGE_SIZE)->size);
+    //~ }
+    //~ if ((arenas->brk - arenas->start) / PAGE_SIZE >= 11) {
+        //~ printf("Current fence value at 11th page: %ld\n", FENCE_BACKWARD(arenas->start + 11 * PAGE_SIZE)->size);
+    //~ }
+    #endif /* DEBUG != 0 */
+
+    return malloc_fnode_assign_free(start, size);
+}
+
+/* 
+ * The smallest header a mapping of 'size' may get: file-backed ones also
+ * hold their descriptor. A spill budget may call for a file at any size.
+ */
+static size_t malloc_mmap_header(size_t size, size_t alignment)
+{
+    if (alignment <= ALIGN_SIZE && ((memfd_threshold != 0 && size >= memfd_threshold) || 
+        malloc_spill_over(size, 0) || (__atomic_load_n(&spill.dir, __ATOMIC_ACQUIRE) >= 0 && 
+        __atomic_load_n(&spill.budget, __ATOMIC_RELAXED) != 0))) {
+        return FDCHUNK_SIZE;
+    }
+    return MCHUNK_SIZE;
+}
+
+/* 
+ * Map a chunk of 'size' (already rounded) on its own, reusing a cached
+ * mapping if one fits. Alignments above ALIGN_SIZE trim the mapping's lead.
+ */
+static void *malloc_mmap(size_t size, size_t alignment)
+{
+    size_t usable = size - FENCE_OVERHEAD;
+    size_t length, trim;
+    char *base, *user, *end;
+    mchunk_t chunk;
+    size_t fresh = FRESH_BIT;
+    int fd;
+
+    if (0 == PAGE_SIZE) {
+        PAGE_SIZE = sysconf(_SC_PAGESIZE);
+    }
+    if (alignment <= ALIGN_SIZE && malloc_spill_over(size, 1)) {
+        __atomic_add_fetch(&spill.users, 1, __ATOMIC_SEQ_CST);
+        if ((fd = __atomic_load_n(&spill.dir, __ATOMIC_SEQ_CST)) >= 0) {
+            fd = tmpfile_memory(fd, length = ROUNDUP_PAGE(FDCHUNK_SIZE + usable));
+        }
+        __atomic_sub_fetch(&spill.users, 1, __ATOMIC_RELEASE);
+        /* Memory it is then, if the file cannot be made */
+        if (fd >= 0 && (user = malloc_mmap_file(length, fd)) != NULL) {
+            return user;
+        }
+    }
+    if (memfd_threshold != 0 && size >= memfd_threshold && alignment <= ALIGN_SIZE) {
+        length = ROUNDUP_PAGE(FDCHUNK_SIZE + usable);
+        if ((fd = memfd_memory(length)) < 0) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        return malloc_mmap_file(length, fd);
+    }
+    if (alignment <= ALIGN_SIZE) {
+        length = ROUNDUP_PAGE(MCHUNK_SIZE + usable);
+        if ((base = malloc_mcache_get(length, &length)) != NULL) {
+            fresh = 0;
+        } else if ((base = map_memory(length)) == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        user = base + MCHUNK_SIZE;
+    } else {
+        length = ROUNDUP_PAGE(MCHUNK_SIZE + usable + alignment);
+        if ((base = map_memory(length)) == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        user = (char*) ROUNDUP_ALIGN((uintptr_t) base + MCHUNK_SIZE, alignment);
+        if ((trim = MCHUNK_BASE(MCHUNK_OF(user)) - base) != 0) {
+            unmap_memory(base, trim);
+            base += trim;
+            length -= trim;
+        }
+        end = (char*) ROUNDUP_PAGE((uintptr_t) user + usable);
+        if (end < base + length) {
+            unmap_memory(end, base + length - end);
+            length = end - base;
+        }
+    }
+    
+    chunk = MCHUNK_OF(user);
+    chunk->length = length;
+    chunk->fence.size = (base + length - user + FENCE_OVERHEAD) | MMAPPED_BIT | fresh;
+    SET_USED(chunk->fence.size);
+    __atomic_add_fetch(&footprint, length, __ATOMIC_RELAXED);
+    return user;
+}
+
+/* 
+ * Map a chunk over the whole of 'fd', a file of 'length' bytes made for
+ * it, shared so the file sees every write. The chunk owns the descriptor.
+ */
+static void *malloc_mmap_file(size_t length, int fd)
+{
+    fdchunk_t fdchunk;
+    char *base;
+
+    if ((base = map_file_memory(fd, length)) == NULL) {
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    fdchunk = (fdchunk_t) base;
+    fdchunk->fd = fd;
+    fdchunk->cloned = 0;
+    fdchunk->file_size = length;
+    fdchunk->chunk.length = length;
+    fdchunk->chunk.fence.size = (length - FDCHUNK_SIZE + FENCE_OVERHEAD) | MMAPPED_BIT | FILE_BIT | FRESH_BIT;
+    SET_USED(fdchunk->chunk.fence.size);
+    return base + FDCHUNK_SIZE;
+}
+
+/* 
+ * Resize a mapped chunk to hold 'size' (a chunk size). Only moves it if
+ * 'may_move' is set. Returns the new user pointer or NULL.
+ */
+static void *malloc_mremap(void *ptr, size_t size, int may_move)
+{
+    mchunk_t chunk = MCHUNK_OF(ptr);
+    char *base = MCHUNK_BASE(chunk);
+    size_t offset = (char*) ptr - base;
+    size_t length = ROUNDUP_PAGE(offset + size - FENCE_OVERHEAD);
+    size_t file = chunk->fence.size & FILE_BIT, old_length;
+
+    if (length != chunk->length) {
+        /* A cloned file is sealed; a shared one only ever grows under its readers */
+        if (file && (FDCHUNK_OF(chunk)->cloned || 
+            (length > FDCHUNK_OF(chunk)->file_size && resize_file_memory(FDCHUNK_OF(chunk)->fd, length) != 0))) {
+            return NULL;
+        }
+        if (file && length > FDCHUNK_OF(chunk)->file_size) {
+            FDCHUNK_OF(chunk)->file_size = length;
+        }
+        old_length = chunk->length;
+        if ((base = remap_memory(base, old_length, length, may_move)) == NULL) {
+            return NULL;
+        }
+        chunk = MCHUNK_OF(base + offset);
+        chunk->length = length;
+        chunk->fence.size = (length - offset + FENCE_OVERHEAD) | MMAPPED_BIT | file;
+        SET_USED(chunk->fence.size);
+        if (!file) {
+            __atomic_add_fetch(&footprint, length - old_length, __ATOMIC_RELAXED);
+        }
+    }
+    return base + offset;
+}
+
+/* Cache a freed mapping for reuse, or unmap it. */
+static void malloc_munmap(mchunk_t chunk)
+{
+    char *base = MCHUNK_BASE(chunk);
+    size_t length = chunk->length;
+    int fd;
+    
+    if (ISFILE(chunk->fence.size)) {
+        fd = FDCHUNK_OF(chunk)->fd;
+        unmap_memory(base, length);
+        close(fd);
+        return;
+    }
+    __atomic_sub_fetch(&footprint, length, __ATOMIC_RELAXED);
+    /* Only whole-page-headed mappings can be handed out again as is */
+    if ((char*) chunk != base || !malloc_mcache_put(base, length)) {
+        unmap_memory(base, length);
+    }
+}
+
+/* The file chunk holding 'ptr', or NULL if it has none. */
+static fdchunk_t malloc_fdchunk_of(void *ptr)
+{
+    if (malloc_arena_of(ptr) != arenas || !ISMMAPPED(FENCE_BACKWARD(ptr)->size) || 
+        !ISFILE(FENCE_BACKWARD(ptr)->size)) {
+        return NULL;
+    }
+    return FDCHUNK_OF(MCHUNK_OF(ptr));
+}
+
+static uint64_t malloc_now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* 
+ * First fit among cached mappings of at least 'length' bytes, wasting no
+ * more than half of one. Stores the mapping's real length in 'got'.
+ */
+static char *malloc_mcache_get(size_t length, size_t *got)
+{
+    struct mcache_entry *entry;
+    char *ret = NULL;
+    unsigned b, i;
+
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_lock(&mcache_mutex);
+    #endif /* PTHREAD_COMPILE != 0 */
+    if (mcache_bytes != 0) {
+        malloc_mcache_decay(malloc_now_ms());
+    }
+    for (b = MCACHE_BUCKET(length); NULL == ret && b < MCACHE_BUCKETS && 
+        b <= MCACHE_BUCKET(length) + 1; b++) {
+        for (i = 0; i < MCACHE_SLOTS; i++) {
+            entry = &mcache[b][i];
+            if (entry->base && entry->length >= length && entry->length / 2 <= length) {
+                ret = entry->base;
+                *got = entry->length;
+                mcache_bytes -= entry->length;
+                entry->base = NULL;
+                break;
+            }
+        }
+    }
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_unlock(&mcache_mutex);
+    #endif /* PTHREAD_COMPILE != 0 */
+    return ret;
+}
+
+/* 
+ * Keep a mapping in its bucket, evicting the bucket's oldest if it is full.
+ * The pages are purged first, so a cached mapping costs address space only.
+ */
+static int malloc_mcache_put(char *base, size_t length)
+{
+    struct mcache_entry *entry, *oldest = NULL;
+    uint64_t now;
+    unsigned b, i;
+    int kept;
+    
+    if (length > mcache_max) {
+        return 0;
+    }
+    purge_memory(base, length);
+    now = malloc_now_ms();
+    b = MCACHE_BUCKET(length);
+
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_lock(&mcache_mutex);
+    #endif /* PTHREAD_COMPILE != 0 */
+    malloc_mcache_decay(now);
+    for (i = 0; i < MCACHE_SLOTS; i++) {
+        entry = &mcache[b][i];
+        if (NULL == entry->base) {
+            oldest = entry;
+            break;
+        }
+        if (NULL == oldest || entry->stamp < oldest->stamp) {
+            oldest = entry;
+        }
+    }
+    if (oldest->base) {
+        unmap_memory(oldest->base, oldest->length);
+        mcache_bytes -= oldest->length;
+        oldest->base = NULL;
+    }
+    if (mcache_bytes + length <= mcache_max) {
+        oldest->base = base;
+        oldest->length = length;
+        oldest->stamp = now;
+        mcache_bytes += length;
+    }
+    /* Once unlocked, the entry may be taken by another thread */
+    kept = oldest->base == base;
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_unlock(&mcache_mutex);
+    #endif /* PTHREAD_COMPILE != 0 */
+    return kept;
+}
+
+/* Unmap cached mappings that have sat unused for longer than the decay. */
+static void malloc_mcache_decay(uint64_t now)
+{
+    struct mcache_entry *entry;
+    unsigned b, i;
+    for (b = 0; b < MCACHE_BUCKETS; b++) {
+        for (i = 0; i < MCACHE_SLOTS; i++) {
+            entry = &mcache[b][i];
+            if (entry->base && now - entry->stamp > mcache_decay_ms) {
+                unmap_memory(entry->base, entry->length);
+                mcache_bytes -= entry->length;
+                entry->base = NULL;
+            }
+        }
+    }
+}
+
+int mallopt(int param, int value)
+{
+    unsigned i;
+
+    if (value < 0) {
+        return 0;
+    }
+    switch (param) {
+    case M_MMAP_THRESHOLD:
+        /* Mapped chunks must never land in a size class */
+        mmap_threshold = MAX((size_t) value, CLASS_MAX_CHUNK + ALIGN_SIZE);
+        return 1;
+    case M_MMAP_CACHE_MAX:
+        mcache_max = value;
+        return 1;
+    case M_MMAP_CACHE_DECAY:
+        mcache_decay_ms = value;
+        return 1;
+    case M_MEMFD_THRESHOLD:
+        memfd_threshold = value;
+        return 1;
+    case M_FREE_ORDER:
+    case M_PLACEMENT:
+        /* Every arena, and those made later */
+        for (i = 0; i < __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE); i++) {
+            if (!malloc_arena_opt(i, param, value)) {
+                return 0;
+            }
+        }
+        if (M_FREE_ORDER == param) {
+            free_order = value;
+        } else {
+            fit_policy = value;
+        }
+        return 1;
+    case M_GOOD_FIT_COUNT:
+        good_fit_count = MAX(value, 1);
+        return 1;
+    #if PTHREAD_COMPILE != 0
+    case M_ZERO_POOL:
+        return malloc_zpool_start(value);
+    case M_FREE_ASYNC_THRESHOLD:
+        reclaim.threshold = value;
+        return 1;
+    case M_FREE_ASYNC_MAX:
+        reclaim.max = value;
+        return 1;
+    case M_PARALLEL_THREADS:
+        return malloc_par_start(value);
+    case M_PARALLEL_THRESHOLD:
+        par.threshold = MAX((size_t) value, PAR_GRAIN);
+        return 1;
+    #endif /* PTHREAD_COMPILE != 0 */
+    default:
+        return 0;
+    }
+}
+
+#if PTHREAD_COMPILE != 0
+/* Set the pool's byte limit, starting the worker the first time. */
+static int malloc_zpool_start(size_t max)
+{
+    pthread_t worker;
+    int start;
+
+    pthread_mutex_lock(&zpool.lock);
+    zpool.max = max;
+    start = max != 0 && !zpool.started;
+    zpool.started |= start;
+    pthread_cond_signal(&zpool.wake);
+    pthread_mutex_unlock(&zpool.lock);
+    
+    /* pthread_create allocates, so it must run without the pool lock */
+    if (start) {
+        if (pthread_create(&worker, NULL, malloc_zpool_main, NULL) != 0) {
+            pthread_mutex_lock(&zpool.lock);
+            zpool.max = 0;
+            zpool.started = 0;
+            pthread_mutex_unlock(&zpool.lock);
+            return 0;
+        }
+        pthread_detach(worker);
+    }
+    return 1;
+}
+
+/* Queue a freed medium heap chunk for zeroing. Returns 0 if it does not fit. */
+static int malloc_zpool_put(fence_t target)
+{
+    fnode_t node = (fnode_t) target;
+    size_t size = GETSIZE(target->size);
+    
+    if (ISMMAPPED(target->size) || size < ZPOOL_MIN_CHUNK || size >= mmap_threshold) {
+        return 0;
+    }
+    pthread_mutex_lock(&zpool.lock);
+    if (zpool.bytes + size > zpool.max) {
+        pthread_mutex_unlock(&zpool.lock);
+        return 0;
+    }
+    node->next = zpool.dirty;
+    zpool.dirty = node;
+    zpool.bytes += size;
+    pthread_cond_signal(&zpool.wake);
+    pthread_mutex_unlock(&zpool.lock);
+    return 1;
+}
+
+/* First zeroed chunk of at least 'size' (a chunk size), or NULL. */
+static void *malloc_zpool_get(size_t size)
+{
+    fnode_t node = NULL, *link;
+    unsigned b;
+
+    if (size < ZPOOL_MIN_CHUNK || size >= mmap_threshold) {
+        return NULL;
+    }
+    pthread_mutex_lock(&zpool.lock);
+    for (b = ZPOOL_BUCKET(size); NULL == node && b < ZPOOL_BUCKETS; b++) {
+        for (link = &zpool.clean[b]; *link != NULL; link = &(*link)->next) {
+            if (GETSIZE((*link)->size) >= size) {
+                node = *link;
+                *link = node->next;
+                zpool.counts[b]--;
+                zpool.bytes -= GETSIZE(node->size);
+                pthread_cond_signal(&zpool.wake);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&zpool.lock);
+    if (NULL == node) {
+        return NULL;
+    }
+    /* The link was the only non-zero word */
+    node->next = NULL;
+    return (char*) node + FENCE_SIZE;
+}
+
+/* The zeroing worker. Zeroes queued chunks first, then refills buckets. */
+static void *malloc_zpool_main(void *arg)
+{
+    fnode_t node;
+    fence_t fresh;
+    unsigned b, refill;
+    size_t size;
+
+    pthread_mutex_lock(&zpool.lock);
+    for (;;) {
+        if (zpool.bytes > zpool.max) {
+            /* The limit was lowered; hand chunks back, dirty ones first */
+            if ((node = zpool.dirty) != NULL) {
+                zpool.dirty = node->next;
+            }
+            for (b = 0; NULL == node && b < ZPOOL_BUCKETS; b++) {
+                if ((node = zpool.clean[b]) != NULL) {
+                    zpool.clean[b] = node->next;
+                    zpool.counts[b]--;
+                }
+            }
+            zpool.bytes -= GETSIZE(node->size);
+            pthread_mutex_unlock(&zpool.lock);
+            malloc_release((fence_t) node);
+            pthread_mutex_lock(&zpool.lock);
+            continue;
+        }
+        if ((node = zpool.dirty) != NULL) {
+            zpool.dirty = node->next;
+            pthread_mutex_unlock(&zpool.lock);
+            size = GETSIZE(node->size);
+            malloc_zero((char*) node + FENCE_SIZE, size - FENCE_OVERHEAD);
+            pthread_mutex_lock(&zpool.lock);
+            b = ZPOOL_BUCKET(size);
+            node->next = zpool.clean[b];
+            zpool.clean[b] = node;
+            zpool.counts[b]++;
+            continue;
+        }
+        
+        refill = ZPOOL_BUCKETS;
+        for (b = 0; b < ZPOOL_BUCKETS; b++) {
+            size = ZPOOL_BUCKET_CHUNK(b);
+            if (zpool.counts[b] < ZPOOL_TARGET && size < mmap_threshold && 
+                zpool.bytes + size <= zpool.max) {
+                refill = b;
+                break;
+            }
+        }
+        if (refill == ZPOOL_BUCKETS) {
+            pthread_cond_wait(&zpool.wake, &zpool.lock);
+            continue;
+        }
+        
+        /* Count the chunk before unlocking so the limit holds */
+        zpool.bytes += size;
+        pthread_mutex_unlock(&zpool.lock);
+        if ((fresh = malloc_chunk(arenas, size)) != NULL) {
+            fresh = FENCE_BACKWARD(fresh);
+            size = GETSIZE(fresh->size);
+            malloc_zero(fresh + 1, size - FENCE_OVERHEAD);
+        }
+        pthread_mutex_lock(&zpool.lock);
+        if (NULL == fresh) {
+            zpool.bytes -= ZPOOL_BUCKET_CHUNK(refill);
+            pthread_cond_wait(&zpool.wake, &zpool.lock);
+            continue;
+        }
+        zpool.bytes += size - ZPOOL_BUCKET_CHUNK(refill);
+        node = (fnode_t) fresh;
+        node->next = zpool.clean[refill];
+        zpool.clean[refill] = node;
+        zpool.counts[refill]++;
+    }
+    return arg;
+}
+
+/* 
+ * Queue a chunk for the reclaimer, starting it the first time. Returns 0
+ * if the queue is full or the thread cannot start.
+ */
+static int malloc_reclaim_put(fence_t target)
+{
+    fnode_t node = (fnode_t) target, orphans;
+    size_t size = GETSIZE(target->size);
+    pthread_t worker;
+
+    pthread_mutex_lock(&reclaim.lock);
+    if (reclaim.bytes + size > reclaim.max) {
+        pthread_mutex_unlock(&reclaim.lock);
+        return 0;
+    }
+    reclaim.bytes += size;
+    if (reclaim.started) {
+        node->next = reclaim.queue;
+        reclaim.queue = node;
+        pthread_cond_signal(&reclaim.wake);
+        pthread_mutex_unlock(&reclaim.lock);
+        return 1;
+    }
+    reclaim.started = 1;
+    pthread_mutex_unlock(&reclaim.lock);
+
+    /* pthread_create allocates, so it must run without the lock */
+    if (pthread_create(&worker, NULL, malloc_reclaim_main, NULL) != 0) {
+        /* Chunks queued by others meanwhile have no worker either; release them here */
+        pthread_mutex_lock(&reclaim.lock);
+        reclaim.started = 0;
+        reclaim.bytes -= size;
+        orphans = reclaim.queue;
+        reclaim.queue = NULL;
+        pthread_mutex_unlock(&reclaim.lock);
+        while (orphans != NULL) {
+            node = orphans;
+            orphans = node->next;
+            size = GETSIZE(node->size);
+            malloc_release((fence_t) node);
+            pthread_mutex_lock(&reclaim.lock);
+            reclaim.bytes -= size;
+            pthread_mutex_unlock(&reclaim.lock);
+        }
+        return 0;
+    }
+    pthread_detach(worker);
+    
+    pthread_mutex_lock(&reclaim.lock);
+    node->next = reclaim.queue;
+    reclaim.queue = node;
+    pthread_cond_signal(&reclaim.wake);
+    pthread_mutex_unlock(&reclaim.lock);
+    return 1;
+}
+
+/* The reclaimer: release queued chunks one at a time. */
+static void *malloc_reclaim_main(void *arg)
+{
+    fnode_t node;
+    size_t size;
+
+    pthread_mutex_lock(&reclaim.lock);
+    for (;;) {
+        while (NULL == (node = reclaim.queue)) {
+            pthread_cond_wait(&reclaim.wake, &reclaim.lock);
+        }
+        reclaim.queue = node->next;
+        pthread_mutex_unlock(&reclaim.lock);
+        
+        size = GETSIZE(node->size);
+        malloc_release((fence_t) node);
+
+        /* Uncount only once released, so the limit covers the work too */
+        pthread_mutex_lock(&reclaim.lock);
+        reclaim.bytes -= size;
+    }
+    return arg;
+}
+
+/* Set the number of helper threads, starting any that are missing. */
+static int malloc_par_start(unsigned threads)
+{
+    pthread_t worker;
+
+    pthread_mutex_lock(&par.lock);
+    par.want = threads;
+    pthread_mutex_unlock(&par.lock);
+    
+    /* Helpers are never stopped; extra ones just share the parts */
+    while (par.threads < threads) {
+        if (pthread_create(&worker, NULL, malloc_par_main, NULL) != 0) {
+            return 0;
+        }
+        pthread_detach(worker);
+        pthread_mutex_lock(&par.lock);
+        par.threads++;
+        pthread_mutex_unlock(&par.lock);
+    }
+    return 1;
+}
+
+/* 
+ * Zero (src NULL) or copy 'n' bytes with the helpers' help. Returns 0,
+ * leaving the work to the caller, if another job is already running.
+ */
+static int malloc_par_run(void *dst, const void *src, size_t n)
+{
+    unsigned parts;
+
+    if (pthread_mutex_trylock(&par.busy) != 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&par.lock);
+    parts = MIN(par.want, par.threads) + 1;
+    par.dst = dst;
+    par.src = src;
+    par.len = ROUNDUP_8(n);
+    par.part = ROUNDUP_ALIGN(par.len / parts + 1, PAR_GRAIN);
+    par.parts = (par.len + par.part - 1) / par.part;
+    par.next = 0;
+    par.finished = 0;
+    pthread_cond_broadcast(&par.wake);
+    pthread_mutex_unlock(&par.lock);
+    
+    malloc_par_parts();
+    
+    pthread_mutex_lock(&par.lock);
+    while (par.finished < par.parts) {
+        pthread_cond_wait(&par.done, &par.lock);
+    }
+    pthread_mutex_unlock(&par.lock);
+    pthread_mutex_unlock(&par.busy);
+    return 1;
+}
+
+/* Take parts of the current job until none are left. */
+static void malloc_par_parts(void)
+{
+    size_t offset, len;
+
+    pthread_mutex_lock(&par.lock);
+    while (par.next < par.parts) {
+        offset = par.next++ * par.part;
+        len = MIN(par.part, par.len - offset);
+        pthread_mutex_unlock(&par.lock);
+        if (NULL == par.src) {
+            malloc_zero_words(par.dst + offset, len);
+        } else {
+            malloc_copy_words(par.dst + offset, par.src + offset, len);
+        }
+        pthread_mutex_lock(&par.lock);
+        if (++par.finished == par.parts) {
+            pthread_cond_signal(&par.done);
+        }
+    }
+    pthread_mutex_unlock(&par.lock);
+}
+
+static void *malloc_par_main(void *arg)
+{
+    for (;;) {
+        pthread_mutex_lock(&par.lock);
+        while (par.next >= par.parts) {
+            pthread_cond_wait(&par.wake, &par.lock);
+        }
+        pthread_mutex_unlock(&par.lock);
+        malloc_par_parts();
+    }
+    return arg;
+}
+#endif /* PTHREAD_COMPILE != 0 */
+
+/* Put this thread on the list the epoch can only advance past together. */
+static void malloc_epoch_register(void)
+{
+    #if PTHREAD_COMPILE != 0
+    pthread_once(&epoch_once, malloc_epoch_key_create);
+    pthread_setspecific(epoch_key, &ethread);
+    pthread_mutex_lock(&epoch_mutex);
+    #endif /* PTHREAD_COMPILE != 0 */
+    ethread.next = epoch_threads;
+    epoch_threads = &ethread;
+    ethread.registered = 1;
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_unlock(&epoch_mutex);
+    #endif /* PTHREAD_COMPILE != 0 */
+}
+
+/* At thread exit, leave the list and hand any pending bags to the orphans. */
+static void malloc_epoch_unregister(void *thread)
+{
+    struct ethread *self = thread, **link;
+    struct eblock *block;
+    unsigned i;
+
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_lock(&epoch_mutex);
+    #endif /* PTHREAD_COMPILE != 0 */
+    for (link = &epoch_threads; *link != NULL; link = &(*link)->next) {
+        if (*link == self) {
+            *link = self->next;
+            break;
+        }
+    }
+    for (i = 0; i < 3; i++) {
+        while ((block = self->bags[i].blocks) != NULL) {
+            self->bags[i].blocks = block->next;
+            block->next = epoch_orphans.blocks;
+            epoch_orphans.blocks = block;
+        }
+        if (self->bags[i].count != 0) {
+            epoch_orphans.epoch = MAX(epoch_orphans.epoch, self->bags[i].epoch);
+            epoch_orphans.count += self->bags[i].count;
+            self->bags[i].count = 0;
+        }
+    }
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_unlock(&epoch_mutex);
+    #endif /* PTHREAD_COMPILE != 0 */
+    self->registered = 0;
+}
+
+#if PTHREAD_COMPILE != 0
+static void malloc_epoch_key_create(void)
+{
+    pthread_key_create(&epoch_key, malloc_epoch_unregister);
+}
+#endif /* PTHREAD_COMPILE != 0 */
+
+/* 
+ * Advance the epoch if every reader has caught up with it, then release
+ * this thread's bags, and the orphans, that are two epochs behind.
+ */
+static void malloc_epoch_collect(struct ethread *self)
+{
+    struct ethread *thread;
+    uint64_t epoch, state;
+    struct ebag orphans = { NULL, 0, 0 };
+    unsigned i;
+    int behind = 0;
+
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_lock(&epoch_mutex);
+    #endif /* PTHREAD_COMPILE != 0 */
+    epoch = __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST);
+    for (thread = epoch_threads; thread != NULL && !behind; thread = thread->next) {
+        state = __atomic_load_n(&thread->state, __ATOMIC_SEQ_CST);
+        behind = (state & 1) && (state >> 1) != epoch;
+    }
+    if (!behind) {
+        __atomic_store_n(&epoch_global, ++epoch, __ATOMIC_SEQ_CST);
+    }
+    if (epoch_orphans.count != 0 && epoch_orphans.epoch + 2 <= epoch) {
+        orphans = epoch_orphans;
+        epoch_orphans.blocks = NULL;
+        epoch_orphans.count = 0;
+    }
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_unlock(&epoch_mutex);
+    #endif /* PTHREAD_COMPILE != 0 */
+
+    malloc_ebag_release(&orphans);
+    for (i = 0; i < 3; i++) {
+        if (self->bags[i].count != 0 && self->bags[i].epoch + 2 <= epoch) {
+            malloc_ebag_release(&self->bags[i]);
+        }
+    }
 }
 
-/* Increase break, return a free node at the new break. */
-static fnode_t malloc_expand(size_t size)
+/* Release every chunk in a bag, and the blocks that held them, as one batch. */
+static void malloc_ebag_release(struct ebag *bag)
 {
-    char *start, *end;
-    char init = 0;
-    if (0 == size)
-        return NULL;
-    /* Initialize if first time running malloc */
-    if (0 == PAGE_SIZE) {
-        init = 1;
-        PAGE_SIZE = sysconf(_SC_PAGESIZE);
-        size = ROUNDUP_PAGE(size + FENCE_OVERHEAD);
-    } else {
-        size = ROUNDUP_PAGE(size);
+    struct eblock *block, *next;
+    fnode_t node, list = NULL;
+    unsigned i;
+
+    /* Nothing can see these chunks now, so they can be linked through */
+    for (block = bag->blocks; block != NULL; block = next) {
+        next = block->next;
+        for (i = 0; i < block->count; i++) {
+            node = (fnode_t) FENCE_BACKWARD(block->ptrs[i]);
+            node->next = list;
+            list = node;
+        }
+        node = (fnode_t) FENCE_BACKWARD(block);
+        node->next = list;
+        list = node;
     }
-    if ((start = get_memory(size)) == NULL) {
-        return NULL;
+    bag->blocks = NULL;
+    bag->count = 0;
+    malloc_release_batch(list);
+}
+
+/* Merge sort a 'next'-linked list of chunks by address. */
+static fnode_t malloc_list_sort(fnode_t list)
+{
+    fnode_t slow = list, fast, left, right, *tail, ret;
+    
+    if (NULL == list || NULL == list->next) {
+        return list;
     }
-    if (1 == init) {
-        HEAP_START = start;
+    for (fast = list->next; fast != NULL && fast->next != NULL; fast = fast->next->next) {
+        slow = slow->next;
     }
+    right = malloc_list_sort(slow->next);
+    slow->next = NULL;
+    left = malloc_list_sort(list);
     
-    /* Two cases; getting an isolated chunk or a neighboring chunk */
-    
-    /* Fence the higher end of the allocated chunk */
-    end = get_memory(0);
-    FENCE_BACKWARD(end)->size = 1;
-    size = end - start;
-    if (HEAP_BREAK + 1 < start) {
-        /* Fence the lower end */
-        ((fence_t) start)->size = 1;
-        start += FENCE_SIZE;
-        size -= 2 * FENCE_SIZE;
-    } else {
-        /* Absorb the previous fence */
-        start -= FENCE_SIZE;
+    for (tail = &ret; left != NULL && right != NULL; tail = &(*tail)->next) {
+        if (left < right) {
+            *tail = left;
+            left = left->next;
+        } else {
+            *tail = right;
+            right = right->next;
+        }
     }
-    HEAP_BREAK = end;
-    
-    #if DEBUG != 0
-    //~ printf("Current number of pages: %ld\n", (HEAP_BREAK - HEAP_START) / PAGE_SIZE);
-    //~ printf("Current fence value at the end: %ld\n", FENCE_BACKWARD(HEAP_BREAK)->size);
-    //~ printf("Current recorded break: %p\n", HEAP_BREAK);
-    //~ printf("Current actual break: %p\n", sbrk(0));
+    *tail = left != NULL ? left : right;
+    return ret;
+}
 
-    //~ if ((HEAP_BREAK - HEAP_START) / PAGE_SIZE >= 9) {
-        //~ printf("Current fence value at 9th page: %ld\n", FENCE_BACKWARD(HEAP_START + 9 * PAGE_SIZE)->size);
-    //~ }
-    //~ if ((HEAP_BREAK - HEAP_START) / PAGE_SIZE >= 10) {
-        //~ printf("Current fence value at 10th page: %ld\n", FENCE_BACKWARD(HEAP_START + 10 * PAGE_SIZE)->size);
-    //~ }
-    //~ if ((HEAP_BREAK - HEAP_START) / PAGE_SIZE >= 11) {
-        //~ printf("Current fence value at 11th page: %ld\n", FENCE_BACKWARD(HEAP_START + 11 * PAGE_SIZE)->size);
-    //~ }
-    #endif /* DEBUG != 0 */
+/* 
+ * Release a 'next'-linked list of used chunks in address order, taking the
+ * heap lock once, so neighbors coalesce as they go back.
+ */
+static void malloc_release_batch(fnode_t list)
+{
+    fnode_t node, next, mapped = NULL;
+    struct arena *arena, *locked = NULL;
 
-    return malloc_fnode_assign_free(start, size);
+    if (NULL == list) {
+        return;
+    }
+    list = malloc_list_sort(list);
+    for (node = list; node != NULL; node = next) {
+        next = node->next;
+        arena = malloc_arena_of(node);
+        if (arena == arenas && ISMMAPPED(node->size)) {
+            node->next = mapped;
+            mapped = node;
+            continue;
+        }
+        /* Sorted by address, so each arena's chunks come in one run */
+        if (arena != locked) {
+            #if PTHREAD_COMPILE != 0
+            if (locked != NULL) {
+                pthread_mutex_unlock(&locked->lock);
+            }
+            pthread_mutex_lock(&arena->lock);
+            #endif /* PTHREAD_COMPILE != 0 */
+            locked = arena;
+        }
+        if (arena->buddy) {
+            malloc_buddy_release(arena->buddy, (char*) ((fence_t) node + 1));
+        } else {
+            malloc_fnode_release(arena, (fence_t) node);
+        }
+    }
+    #if PTHREAD_COMPILE != 0
+    if (locked != NULL) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+    #endif /* PTHREAD_COMPILE != 0 */
+    for (node = mapped; node != NULL; node = next) {
+        next = node->next;
+        malloc_munmap(MCHUNK_OF((fence_t) node + 1));
+    }
 }
 
 /* Add item to the address-ordered list of free nodes */
@@ -273,62 +2622,123 @@ static void malloc_list_addr_insert(fnode_t *list, fnode_t item)
     }
 }
 
-/* Split the node if possible. 'size' is the size requested (rounded up). */
-static fnode_t malloc_fnode_split(fnode_t *list, fnode_t node, size_t size)
+/* Add item to the arena's free list where its order puts it */
+static void malloc_list_insert(struct arena *arena, fnode_t item)
+{
+    if (MALLOC_ORDER_LIFO == arena->order) {
+        item->prev = NULL;
+        if ((item->next = arena->flist)) {
+            item->next->prev = item;
+        }
+        arena->flist = item;
+    } else {
+        malloc_list_addr_insert(&arena->flist, item);
+    }
+}
+
+/* 
+ * Split the node if possible. 'size' is the size requested (rounded up).
+ * Both halves take the node's place in the list, low half first.
+ */
+static fnode_t malloc_fnode_split(fnode_t node, size_t size)
 {
     char *start = (char*) node;
     char *split = ((char*) node) + size;
     size_t split_size = node->size - size;
+    fnode_t prev = node->prev, next = node->next;
     fnode_t node_new;
 
     if (split_size >= NODE_OVERHEAD) {
-        /* Enough space for a new free node. Insert into the free nodes list */
-        malloc_list_remove(list, node);
+        /* Enough space for a new free node. Link it in after this one */
         node = malloc_fnode_assign_free(start, size);
         node_new = malloc_fnode_assign_free(split, split_size);
-        malloc_list_addr_insert(list, node);
-        malloc_list_addr_insert(list, node_new);
+        node->prev = prev;
+        node->next = node_new;
+        node_new->prev = node;
+        if ((node_new->next = next)) {
+            next->prev = node_new;
+        }
     }
     
     return node;
 }
 
-/* Remove fnode from 'list' */
-static void malloc_list_remove(fnode_t *list, fnode_t node)
+/* Remove fnode from the arena's free list */
+static void malloc_list_remove(struct arena *arena, fnode_t node)
 {
-    fnode_t front = *list;
-    if (*list == node) {
-        if ((*list = node->next)) {
-            (*list)->prev = NULL;
-        }
+    if (arena->rover == node) {
+        arena->rover = node->next;
+    }
+    if (node->prev) {
+        node->prev->next = node->next;
     } else {
-        while (front->next != node) {
-            front = front->next;
-        }
-        if ((front->next = node->next)) {
-            front->next->prev = front;
-        }
+        arena->flist = node->next;
+    }
+    if (node->next) {
+        node->next->prev = node->prev;
     }
 }
 
 /* Add the chunk back to the free list. */
-static void malloc_fnode_release(fnode_t *list, fence_t target) 
+static void malloc_fnode_release(struct arena *arena, fence_t target) 
 {
     fnode_t node;
     SET_FREE(target->size);
     node = malloc_fnode_assign_free((char*)target, target->size);
-    node = malloc_fnode_fuse_up(list, node);
-    node = malloc_fnode_fuse_down(list, node);
+    node = malloc_fnode_fuse_up(arena, node);
+    node = malloc_fnode_fuse_down(arena, node);
+}
+
+/* 
+ * Resize a used chunk in place to between 'min' and 'max' bytes (chunk
+ * sizes), shrinking by splitting off the tail or growing into the next
+ * chunk if it is free. Returns the resulting chunk size.
+ */
+static size_t malloc_fnode_resize(struct arena *arena, fence_t target, size_t min, size_t max)
+{
+    size_t size = GETSIZE(target->size);
+    size_t total;
+    fnode_t next_node;
+    char *tail;
+
+    if (size > max) {
+        if (size - max < NODE_OVERHEAD) {
+            return size;
+        }
+        /* Hand the tail back as a used chunk so release can fuse it */
+        tail = (char*) target + max;
+        malloc_fnode_set_used(target, max);
+        malloc_fnode_assign_used(tail, size - max);
+        malloc_fnode_release(arena, (fence_t) tail);
+        return max;
+    }
+    if (size == max) {
+        return size;
+    }
+    
+    next_node = (fnode_t) ((char*) target + size);
+    if (ISUSED(next_node->size) || size + next_node->size < min) {
+        return size;
+    }
+    total = size + next_node->size;
+    malloc_list_remove(arena, next_node);
+    if (total - MIN(total, max) >= NODE_OVERHEAD) {
+        tail = (char*) target + max;
+        malloc_list_insert(arena, malloc_fnode_assign_free(tail, total - max));
+        total = max;
+    }
+    malloc_fnode_set_used(target, total);
+    return total;
 }
 
 /* Fuse with the neighbor free nodes if possible. */
-static fnode_t malloc_fnode_fuse_up(fnode_t *list, fnode_t node)
+static fnode_t malloc_fnode_fuse_up(struct arena *arena, fnode_t node)
 {
     fence_t prev_backfence = FENCE_BACKWARD(node);
     fnode_t prev_node;
     fence_t curr_backfence;
     if (ISUSED(prev_backfence->size)) {
-        malloc_list_addr_insert(list, node);
+        malloc_list_insert(arena, node);
         return node;
     }
     
@@ -339,7 +2749,7 @@ static fnode_t malloc_fnode_fuse_up(fnode_t *list, fnode_t node)
         #if DEBUG != 0
         if (mark < 2) {
         printf("Inconsistent node size discovered in fuse_up!\n");
-        //malloc_print_free_chunks(*list);
+        //malloc_print_free_chunks(arena->flist);
         printf("previous node shows size: %ld\n", prev_node->size);
         printf("previous fence shows size: %ld\n", prev_backfence->size);
         printf("previous node address: %p\n", prev_node);
@@ -348,17 +2758,22 @@ static fnode_t malloc_fnode_fuse_up(fnode_t *list, fnode_t node)
         }
         #endif /* DEBUG != 0 */
 
-        malloc_list_addr_insert(list, node);
+        malloc_list_insert(arena, node);
         return node;
     }
     
     curr_backfence = FENCE_BACKWARD((char*) node + node->size);
     prev_node->size += node->size;
     curr_backfence->size = prev_node->size;
+    /* The merged node holds the bytes just freed; put it up front */
+    if (MALLOC_ORDER_LIFO == arena->order && prev_node != arena->flist) {
+        malloc_list_remove(arena, prev_node);
+        malloc_list_insert(arena, prev_node);
+    }
     return prev_node;
 }
 
-static fnode_t malloc_fnode_fuse_down(fnode_t *list, fnode_t node)
+static fnode_t malloc_fnode_fuse_down(struct arena *arena, fnode_t node)
 {
     fence_t curr_backfence = FENCE_BACKWARD((char*) node + node->size);
     fnode_t next_node = (fnode_t) (curr_backfence + 1); 
@@ -372,13 +2787,10 @@ static fnode_t malloc_fnode_fuse_down(fnode_t *list, fnode_t node)
             return node;
     }
     
+    malloc_list_remove(arena, next_node);
     node->size += next_node->size;
     next_backfence->size = node->size;
     
-    if ((node->next = next_node->next)) {
-        node->next->prev = node;
-    }
-    
     next_node->prev = NULL;
     next_node->next = NULL;
     return node;
@@ -404,7 +2816,7 @@ static void malloc_print_free_chunks(fnode_t front)
     int i = 0;
     size_t footer_size;
     printf("Listing each chunk... ");
-    printf("Heap starts at %p, breaks at %p.\n", HEAP_START, HEAP_BREAK);
+    printf("Heap starts at %p, breaks at %p.\n", arenas->start, arenas->brk);
     while (front != NULL) {
         printf("Chunk %d: ", i++);
         printf("Header shows size %ld. ", front->size);
@@ -419,14 +2831,14 @@ static void malloc_print_free_chunks(fnode_t front)
 
 static void malloc_print_all_chunks()
 {
-    char *start = HEAP_START + FENCE_SIZE;
+    char *start = arenas->start + FENCE_SIZE;
     fence_t front = (fence_t) start;
     fence_t back;
     int i = 0;
     size_t real_size;
     size_t footer_size;
     printf("Listing each used/free chunk... ");
-    printf("Heap starts at %p, breaks at %p.\n", HEAP_START, HEAP_BREAK);
+    printf("Heap starts at %p, breaks at %p.\n", arenas->start, arenas->brk);
     while (front->size != 1) {
         printf("Chunk %d, %p: ", i++, front);
         real_size = GETSIZE(front->size);
@@ -466,10 +2878,102 @@ static inline size_t highest(size_t in)
     return num_bits;
 }
 
+/* Zero 'n' bytes, rounded up to a word; chunks always have the room. */
+static inline void malloc_zero(void *ptr, size_t n)
+{
+    #if PTHREAD_COMPILE != 0
+    if (n >= par.threshold && par.want != 0 && malloc_par_run(ptr, NULL, n)) {
+        return;
+    }
+    #endif /* PTHREAD_COMPILE != 0 */
+    malloc_zero_words(ptr, n);
+}
+
+/* Copy 'n' bytes between chunks, rounded up to a word. */
+static inline void malloc_copy(void *dst, const void *src, size_t n)
+{
+    #if PTHREAD_COMPILE != 0
+    if (n >= par.threshold && par.want != 0 && malloc_par_run(dst, src, n)) {
+        return;
+    }
+    #endif /* PTHREAD_COMPILE != 0 */
+    malloc_copy_words(dst, src, n);
+}
+
+static inline void malloc_zero_words(void *ptr, size_t n)
+{
+    size_t *target = ptr;
+    size_t *end = target + ROUNDUP_8(n) / SIZE_T_SIZE;
+    while (target < end) {
+        *(target++) = 0;
+    }
+}
+
+static inline void malloc_copy_words(void *dst, const void *src, size_t n)
+{
+    const size_t *source = src;
+    size_t *target = dst;
+    size_t *end = target + ROUNDUP_8(n) / SIZE_T_SIZE;
+    while (target < end) {
+        *(target++) = *(source++);
+    }
+}
+
+/* Find 'ptr' of 'size' usable bytes in this thread's table of growing blocks. */
+static struct grow_entry *malloc_grow_find(void *ptr, size_t size)
+{
+    unsigned i;
+    for (i = 0; i < GROW_ENTRIES; i++) {
+        if (grow_table[i].ptr == ptr && grow_table[i].size == size) {
+            return &grow_table[i];
+        }
+    }
+    return NULL;
+}
+
+/* 
+ * Note that a block grew and now lives at 'ptr'. 'entry' is its slot from
+ * malloc_grow_find, or NULL to start a streak in the oldest slot.
+ */
+static void malloc_grow_record(struct grow_entry *entry, void *ptr)
+{
+    if (NULL == entry) {
+        entry = &grow_table[grow_next++ % GROW_ENTRIES];
+        entry->streak = 0;
+    }
+    entry->ptr = ptr;
+    entry->size = malloc_usable_size(ptr);
+    entry->streak++;
+}
+
+/* Try to grow or shrink the chunk behind 'ptr' without moving it. */
+static size_t malloc_resize_in_place(void *ptr, size_t min, size_t max)
+{
+    struct arena *arena = malloc_arena_of(ptr);
+    size_t ret;
+    /* Buddy blocks keep their order */
+    if (arena->buddy) {
+        return malloc_usable_size(ptr);
+    }
+    if (arena == arenas && ISMMAPPED(FENCE_BACKWARD(ptr)->size)) {
+        if (NULL == malloc_mremap(ptr, max, 0)) {
+            malloc_mremap(ptr, min, 0);
+        }
+        return malloc_usable_size(ptr);
+    }
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_lock(&arena->lock);
+    #endif /* PTHREAD_COMPILE != 0 */
+    ret = malloc_fnode_resize(arena, FENCE_BACKWARD(ptr), min, max);
+    #if PTHREAD_COMPILE != 0
+    pthread_mutex_unlock(&arena->lock);
+    #endif /* PTHREAD_COMPILE != 0 */
+    return ret - FENCE_OVERHEAD;
+}
+
 void* calloc(size_t number, size_t size) 
 {
     size_t number_size = 0;
-    size_t *target, *end;
     
     /* This prevents an integer overflow.  A size_t is a typedef to an integer
      * large enough to index all of memory.  If we cannot fit in a size_t, then
@@ -481,25 +2985,40 @@ void* calloc(size_t number, size_t size)
     }
 
     number_size = number * size;
-    void* ret = malloc(number_size);
+    void* ret;
 
-    if (ret) {
-        target = ret;
-        end = target + ROUNDUP_16(number_size) / SIZE_T_SIZE;
-        while (target < end) {
-            *(target++) = 0;
-        }
+    #if PTHREAD_COMPILE != 0
+    if (zpool.max != 0 && number_size <= SIZE_MAX / 2 && 
+        (ret = malloc_zpool_get(ROUNDUP_CHUNK(number_size))) != NULL) {
+        return malloc_tag_give(ret, tag_deltas.current);
+    }
+    #endif /* PTHREAD_COMPILE != 0 */
+    ret = malloc(number_size);
+
+    /* Fresh mappings come zeroed from the kernel */
+    if (ret && !ISFRESH(FENCE_BACKWARD(ret)->size)) {
+        malloc_zero(ret, ROUNDUP_16(number_size));
     }
     
     return ret;
 }
 
 void* realloc(void *ptr, size_t size) 
+{
+    return realloc_used(ptr, size, SIZE_MAX);
+}
+
+/* 
+ * realloc that only carries the first 'used' bytes over when the block has
+ * to move; whatever follows them is left uninitialized.
+ */
+void *realloc_used(void *ptr, size_t size, size_t used)
 {
     /* Set this to the size of the buffer pointed to by ptr */
-    size_t old_size;
+    size_t old_size, alloc;
+    struct grow_entry *entry;
+    unsigned tag, current;
     void* ret;
-    size_t *source, *target, *end;
 
     if (NULL == ptr) {
         return malloc(size);
@@ -509,17 +3028,84 @@ void* realloc(void *ptr, size_t size)
         return NULL;
     }
     
-    old_size = GETSIZE(FENCE_BACKWARD(ptr)->size) - FENCE_OVERHEAD;
+    old_size = malloc_usable_size(ptr);
     if (old_size >= size)
         return ptr;
-    
-    if ((ret = malloc(size))) {
-        source = ptr;
-        target = ret;
-        end = target + old_size / SIZE_T_SIZE;
-        while (target < end) {
-            *(target++) = *(source++);
+    if (size > SIZE_MAX / 2) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    /* 
+     * A block that keeps growing is probably an append loop; give it half
+     * again as much room so the next few reallocs are free.
+     */
+    entry = malloc_grow_find(ptr, old_size);
+    alloc = size;
+    if (entry && entry->streak >= GROW_STREAK) {
+        alloc = MIN(size + size / 2, SIZE_MAX / 2);
+    }
+
+    /* 
+     * Reserve the growth, headroom and all, under the block's tag first.
+     * Growing rewrites the header, so the tag comes off and goes back on
+     * wherever the block ends up.
+     */
+    tag = malloc_tag_of(ptr);
+    if (!malloc_tag_claim(tag, alloc - old_size)) {
+        alloc = size;
+        if (!malloc_tag_claim(tag, alloc - old_size)) {
+            errno = ENOMEM;
+            return NULL;
         }
+    }
+    malloc_tag_drop(ptr);
+    /* A move goes through malloc; the claim already covers it */
+    current = tag_deltas.current;
+    tag_deltas.current = 0;
+    ret = malloc_grow(ptr, size, alloc, used, old_size);
+    tag_deltas.current = current;
+    malloc_tag_put(ret ? ret : ptr, tag, 0);
+    malloc_tag_unclaim(tag, alloc - old_size);
+    if (ret != NULL) {
+        malloc_grow_record(entry, ret);
+    }
+    return ret;
+}
+
+/* 
+ * Grow 'ptr' of 'old_size' usable bytes to 'size', in place or not, with
+ * room for 'alloc' if that can be had.
+ */
+static void *malloc_grow(void *ptr, size_t size, size_t alloc, size_t used, size_t old_size)
+{
+    struct arena *arena;
+    void* ret;
+
+    /* A size-class block grown past the classes leaves the small arena */
+    arena = malloc_arena_of(ptr);
+    if (!(arena->cached && arena != arenas && ROUNDUP_CHUNK(size) > CLASS_MAX_CHUNK) && 
+        malloc_resize_in_place(ptr, ROUNDUP_CHUNK(size), ROUNDUP_CHUNK(alloc)) >= size) {
+        return ptr;
+    }
+    
+    /* Large mappings can move without a copy */
+    if (arena == arenas && ISMMAPPED(FENCE_BACKWARD(ptr)->size) && 
+        ROUNDUP_CHUNK(alloc) >= mmap_threshold && 
+        (ret = malloc_mremap(ptr, ROUNDUP_CHUNK(alloc), 1))) {
+        return ret;
+    }
+    
+    /* 
+     * A moved block stays in its arena. Blocks of arena 0 and the small
+     * arena go where their new size belongs, which malloc decides.
+     */
+    if (arena->cached) {
+        arena = arenas;
+    }
+    if ((ret = malloc_arena_alloc(arena, alloc)) || 
+        (alloc > size && (ret = malloc_arena_alloc(arena, size)))) {
+        malloc_copy(ret, ptr, MIN(old_size, used));
         free(ptr);
     } else {
         errno = ENOMEM;
@@ -528,3 +3114,230 @@ void* realloc(void *ptr, size_t size)
     
     return ret;
 }
+
+/* 
+ * A copy of the block: a second private mapping of a memfd block's file,
+ * or else a fresh block with the contents copied.
+ */
+void *malloc_clone(void *ptr)
+{
+    fdchunk_t fdchunk = NULL == ptr ? NULL : malloc_fdchunk_of(ptr);
+    size_t length;
+    char *base, *copy;
+    int fd;
+
+    if (fdchunk != NULL && !fdchunk->cloned) {
+        /* 
+         * Switch this block to a private mapping of its file and freeze
+         * the file, so neither side's later writes reach the other. If
+         * someone else has it mapped writable the seal fails; copy then.
+         */
+        base = (char*) fdchunk;
+        length = fdchunk->chunk.length;
+        if (NULL == map_file_memory_at(fdchunk->fd, length, base, 0)) {
+            fdchunk = NULL;
+        } else if (seal_file_memory(fdchunk->fd) != 0) {
+            map_file_memory_at(fdchunk->fd, length, base, 1);
+            fdchunk = NULL;
+        } else {
+            fdchunk->cloned = 1;
+        }
+    }
+    if (fdchunk != NULL) {
+        length = fdchunk->chunk.length;
+        if ((fd = dup(fdchunk->fd)) >= 0) {
+            if ((base = map_file_memory_at(fd, length, NULL, 0)) != NULL) {
+                ((fdchunk_t) base)->fd = fd;
+                ((fdchunk_t) base)->cloned = 1;
+                /* The header came along with the data, tag and all */
+                ((fdchunk_t) base)->chunk.fence.size &= ~TAG_MASK;
+                return malloc_tag_give(base + FDCHUNK_SIZE, tag_deltas.current);
+            }
+            close(fd);
+        }
+    }
+    /* Anything else is copied */
+    if (NULL == ptr || (copy = malloc(malloc_usable_size(ptr))) == NULL) {
+        return NULL;
+    }
+    malloc_copy(copy, ptr, malloc_usable_size(ptr));
+    return copy;
+}
+
+int malloc_export_fd(void *ptr, size_t *offset)
+{
+    fdchunk_t fdchunk = NULL == ptr ? NULL : malloc_fdchunk_of(ptr);
+    int fd;
+
+    if (NULL == fdchunk || fdchunk->cloned) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((fd = dup(fdchunk->fd)) >= 0 && offset != NULL) {
+        *offset = (char*) ptr - (char*) fdchunk;
+    }
+    return fd;
+}
+
+int malloc_spill(const char *dir, size_t threshold, size_t budget)
+{
+    int fd = -1, probe;
+
+    if (dir != NULL) {
+        /* Fail now rather than on the first large block */
+        if ((fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+            return -1;
+        }
+        if ((probe = tmpfile_memory(fd, 0)) < 0) {
+            close(fd);
+            return -1;
+        }
+        close(probe);
+    }
+    __atomic_store_n(&spill.threshold, threshold, __ATOMIC_RELAXED);
+    __atomic_store_n(&spill.budget, budget, __ATOMIC_RELAXED);
+    /* A block being spilled right now may still use the old directory; let it finish */
+    if ((fd = __atomic_exchange_n(&spill.dir, fd, __ATOMIC_SEQ_CST)) >= 0) {
+        while (__atomic_load_n(&spill.users, __ATOMIC_SEQ_CST) != 0) {
+            sched_yield();
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+/* 
+ * Whether a mapped chunk of 'size' goes to a file in the spill directory:
+ * past the threshold or, when 'budget' is set, past the budget.
+ */
+static int malloc_spill_over(size_t size, int budget)
+{
+    size_t threshold = __atomic_load_n(&spill.threshold, __ATOMIC_RELAXED);
+    size_t max = __atomic_load_n(&spill.budget, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&spill.dir, __ATOMIC_ACQUIRE) < 0) {
+        return 0;
+    }
+    return (threshold != 0 && size >= threshold) || 
+        (budget && max != 0 && __atomic_load_n(&footprint, __ATOMIC_RELAXED) + size > max);
+}
+
+/* Reject unknown flags and arenas that have not been created. */
+static int malloc_flags_valid(int flags)
+{
+    return 0 == (flags & ~(MALLOCX_ALIGN_MASK | MALLOCX_ZERO | MALLOCX_TCACHE_NONE | 
+        MALLOCX_ARENA_MASK)) && (0 == (flags & MALLOCX_ARENA_MASK) || 
+        FLAGS_ARENA(flags) < __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE));
+}
+
+void *mallocx(size_t size, int flags)
+{
+    size_t alignment = FLAGS_ALIGNMENT(flags);
+    void *ret;
+
+    if (!malloc_flags_valid(flags) || size > SIZE_MAX / 2) {
+        return NULL;
+    }
+    if ((flags & MALLOCX_ARENA_MASK) && FLAGS_ARENA(flags) != 0) {
+        /* Arenas past the first bypass the thread cache anyway */
+        ret = malloc_aligned(&arenas[FLAGS_ARENA(flags)], alignment, size);
+    } else if (alignment > ALIGN_SIZE) {
+        ret = malloc_aligned(arenas, alignment, size);
+    } else if (flags & MALLOCX_TCACHE_NONE) {
+        ret = malloc_size_chunk(ROUNDUP_CHUNK(size));
+    } else {
+        ret = malloc(size);
+    }
+    if (ret && (flags & MALLOCX_ZERO)) {
+        malloc_zero(ret, size);
+    }
+    return malloc_tag_give(ret, tag_deltas.current);
+}
+
+void dallocx(void *ptr, int flags)
+{
+    if (NULL == ptr) {
+        return;
+    }
+    if (flags & MALLOCX_TCACHE_NONE) {
+        malloc_tag_drop(ptr);
+        malloc_release(FENCE_BACKWARD(ptr));
+    } else {
+        free(ptr);
+    }
+}
+
+size_t xallocx(void *ptr, size_t size, size_t extra, int flags)
+{
+    size_t old_size = malloc_usable_size(ptr);
+    size_t alignment = FLAGS_ALIGNMENT(flags);
+    size_t new_size, claim;
+    unsigned tag;
+
+    if (!malloc_flags_valid(flags) || size > SIZE_MAX / 2 || 
+        (alignment > ALIGN_SIZE && ((uintptr_t) ptr & (alignment - 1)))) {
+        return old_size;
+    }
+    extra = MIN(extra, SIZE_MAX / 2 - size);
+    /* Reserve the most the block may grow by under its tag, or failing that the least */
+    tag = malloc_tag_of(ptr);
+    claim = size + extra > old_size ? size + extra - old_size : 0;
+    if (!malloc_tag_claim(tag, claim)) {
+        extra = 0;
+        claim = size > old_size ? size - old_size : 0;
+        if (!malloc_tag_claim(tag, claim)) {
+            return old_size;
+        }
+    }
+    malloc_tag_drop(ptr);
+    new_size = malloc_resize_in_place(ptr, ROUNDUP_CHUNK(size), ROUNDUP_CHUNK(size + extra));
+    malloc_tag_put(ptr, tag, 0);
+    malloc_tag_unclaim(tag, claim);
+    if ((flags & MALLOCX_ZERO) && new_size > old_size) {
+        malloc_zero((char*) ptr + old_size, new_size - old_size);
+    }
+    return new_size;
+}
+
+void *rallocx(void *ptr, size_t size, int flags)
+{
+    size_t old_size, alignment = FLAGS_ALIGNMENT(flags), claim;
+    unsigned tag, current;
+    void *ret;
+
+    if (NULL == ptr) {
+        return mallocx(size, flags);
+    }
+    old_size = malloc_usable_size(ptr);
+    /* A block that is big enough but misaligned still has to move */
+    if ((0 == alignment || 0 == ((uintptr_t) ptr & (alignment - 1))) && 
+        xallocx(ptr, size, 0, flags) >= size) {
+        return ptr;
+    }
+    /* 
+     * The new block takes over the old one's tag. Reserve the growth under
+     * it, then allocate untagged so the move is not counted twice.
+     */
+    tag = malloc_tag_of(ptr);
+    claim = size > old_size ? size - old_size : 0;
+    if (!malloc_tag_claim(tag, claim)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    current = tag_deltas.current;
+    tag_deltas.current = 0;
+    ret = mallocx(size, flags & ~MALLOCX_ZERO);
+    tag_deltas.current = current;
+    if (NULL == ret) {
+        malloc_tag_unclaim(tag, claim);
+        return NULL;
+    }
+    malloc_copy(ret, ptr, MIN(old_size, size));
+    if ((flags & MALLOCX_ZERO) && size > old_size) {
+        malloc_zero((char*) ret + old_size, malloc_usable_size(ret) - old_size);
+    }
+    malloc_tag_put(ret, tag, 0);
+    malloc_tag_unclaim(tag, claim);
+    dallocx(ptr, flags);
+    return ret;
+}
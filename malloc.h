@@ -3,9 +3,222 @@
 
 #include <stddef.h>
 
-void* malloc(size_t size);
-void* calloc(size_t number, size_t size);
-void* realloc(void *ptr, size_t size);
-void free(void* ptr);
+#ifdef __cplusplus
+/* Match the exception specification libc gives these in C++. */
+#define MALLOC_NOTHROW noexcept
+extern "C" {
+#else
+#define MALLOC_NOTHROW
+#endif /* __cplusplus */
+
+void* malloc(size_t size) MALLOC_NOTHROW;
+void* calloc(size_t number, size_t size) MALLOC_NOTHROW;
+void* realloc(void *ptr, size_t size) MALLOC_NOTHROW;
+void free(void* ptr) MALLOC_NOTHROW;
+
+/* Hand the block to a background thread to free; frees in place if too much is queued. */
+void free_async(void *ptr) MALLOC_NOTHROW;
+
+/* 
+ * Epoch-based deferred free: 'ptr' is released only after every thread
+ * that was between malloc_epoch_enter and malloc_epoch_exit has exited.
+ */
+void free_deferred(void *ptr) MALLOC_NOTHROW;
+void malloc_epoch_enter(void) MALLOC_NOTHROW;
+void malloc_epoch_exit(void) MALLOC_NOTHROW;
+
+/* realloc that copies only the first 'used' bytes if the block moves. */
+void* realloc_used(void *ptr, size_t size, size_t used) MALLOC_NOTHROW;
+
+/* 
+ * A copy of the block. One backed by a memfd (M_MEMFD_THRESHOLD) is not
+ * copied: both become private mappings of the same file, sharing pages
+ * until either side writes to them.
+ */
+void* malloc_clone(void *ptr) MALLOC_NOTHROW;
+/* 
+ * A new descriptor for the file backing the block, its data at '*offset'
+ * in the file, for mmap in another process or sendfile. -1 with EINVAL if
+ * the block has no memfd or spill file or has been cloned.
+ */
+int malloc_export_fd(void *ptr, size_t *offset) MALLOC_NOTHROW;
+
+/* 
+ * Back mapped blocks with unlinked files in 'dir' instead of memory, so
+ * the kernel can page them out: those of at least 'threshold' bytes, and
+ * all of them while the heap and mapped blocks total over 'budget' bytes.
+ * 0 turns either off; a NULL 'dir' turns spilling off. 0, or -1 with
+ * errno if no file can be made in 'dir'.
+ */
+int malloc_spill(const char *dir, size_t threshold, size_t budget) MALLOC_NOTHROW;
+
+/* Aligned allocation. 'alignment' must be a power of two. */
+void* aligned_alloc(size_t alignment, size_t size) MALLOC_NOTHROW;
+int posix_memalign(void **memptr, size_t alignment, size_t size) MALLOC_NOTHROW;
+
+/* Free with the size (and alignment) the block was requested with. */
+void free_sized(void *ptr, size_t size) MALLOC_NOTHROW;
+void free_aligned_sized(void *ptr, size_t alignment, size_t size) MALLOC_NOTHROW;
+
+/* 
+ * Flags for the *allocx family. The low bits hold log2 of the requested
+ * alignment; zero means the default ALIGN_SIZE alignment.
+ */
+#define MALLOCX_LG_ALIGN(la) ((int)(la))
+#define MALLOCX_ALIGN(a) ((int)(__builtin_ctzl((size_t)(a))))
+#define MALLOCX_ALIGN_MASK 0x3f
+/* Zero the new bytes of the allocation. */
+#define MALLOCX_ZERO ((int)0x40)
+/* Bypass the per-thread cache. */
+#define MALLOCX_TCACHE_NONE ((int)0x100)
+/* Allocate from arena 'a'. */
+#define MALLOCX_ARENA(a) ((int)(((unsigned)(a)+1) << 20))
+#define MALLOCX_ARENA_MASK ((int)(0xfffu << 20))
+
+/* Usable size an allocation of 'size' would get, without allocating. */
+size_t nallocx(size_t size, int flags) MALLOC_NOTHROW;
+size_t malloc_good_size(size_t size) MALLOC_NOTHROW;
+/* Usable size of an existing allocation; at least what was requested. */
+size_t malloc_usable_size(void *ptr) MALLOC_NOTHROW;
+
+/* Allocate, free and resize with MALLOCX_* flags. NULL on failure. */
+void* mallocx(size_t size, int flags) MALLOC_NOTHROW;
+void* rallocx(void *ptr, size_t size, int flags) MALLOC_NOTHROW;
+void dallocx(void *ptr, int flags) MALLOC_NOTHROW;
+/* 
+ * Resize in place only, to at least 'size' and at most 'size'+'extra'.
+ * Returns the resulting usable size; the old one if nothing could be done.
+ */
+size_t xallocx(void *ptr, size_t size, size_t extra, int flags) MALLOC_NOTHROW;
+
+/* 
+ * Arenas are separate heaps; MALLOCX_ARENA picks one. Returns the new
+ * arena's index, or -1 if no more can be made.
+ */
+int malloc_arena_create(void) MALLOC_NOTHROW;
+/* 
+ * Arena engines. A buddy arena hands out power-of-two blocks, aligned to
+ * their size, with no header; best for sizes that are powers of two.
+ */
+#define MALLOC_ARENA_FIRST_FIT 0
+#define MALLOC_ARENA_BUDDY 1
+int malloc_arena_create_type(int type) MALLOC_NOTHROW;
+/* 
+ * The same, taking memory from 'backend' (see memreq.h) rather than
+ * anonymous mappings. The backend must outlive the arena.
+ */
+struct memreq_backend;
+int malloc_arena_create_backend(int type, const struct memreq_backend *backend) MALLOC_NOTHROW;
+/* mallopt for one arena; M_FREE_ORDER and M_PLACEMENT apply per arena. */
+int malloc_arena_opt(int arena, int param, int value) MALLOC_NOTHROW;
+
+/* 
+ * Allocate next to blocks expected to live about as long, so transient
+ * blocks do not leave holes around long-lived ones. Free with free().
+ */
+#define MALLOC_SHORT_LIVED 1
+#define MALLOC_LONG_LIVED 2
+void* malloc_hint(size_t size, int lifetime) MALLOC_NOTHROW;
+
+/* 
+ * Allocation tags attribute memory to the parts of a program. Blocks are
+ * counted under the tag current in the allocating thread when they are
+ * made, and keep it through realloc; tag 0, the default, is not counted,
+ * nor are blocks of buddy arenas. Returns the previous tag, or -1 with
+ * EINVAL if 'tag' is not below MALLOC_TAG_COUNT.
+ */
+#define MALLOC_TAG_COUNT 64
+int malloc_set_tag(unsigned tag) MALLOC_NOTHROW;
+/* malloc under 'tag' rather than the current one. */
+void* malloc_tagged(size_t size, unsigned tag) MALLOC_NOTHROW;
+/* 
+ * Limits on a tag's live bytes; 0 is no limit. Allocations that would take
+ * the tag past 'hard' fail with ENOMEM, as does growing a block past it.
+ * Going over 'soft' calls 'hook' in the allocating thread, once each time
+ * it is crossed, so the owner can shed memory; the hook may free and
+ * allocate. 0, or -1 with EINVAL for tag 0 or 'soft' above 'hard'.
+ * Blocks other threads allocated before the limit was set are seen late.
+ */
+typedef void (*malloc_tag_hook_t)(unsigned tag, size_t bytes, void *arg);
+int malloc_tag_limit(unsigned tag, size_t soft, size_t hard, malloc_tag_hook_t hook, void *arg) MALLOC_NOTHROW;
+
+/* Tunables for mallopt. Returns 1 on success, 0 on a bad parameter. */
+#define M_MMAP_THRESHOLD (-3)
+/* Bytes of freed large mappings kept for reuse, and ms before release */
+#define M_MMAP_CACHE_MAX (-100)
+#define M_MMAP_CACHE_DECAY (-101)
+/* Mapped blocks from this size on are backed by a memfd each; 0 is never */
+#define M_MEMFD_THRESHOLD (-110)
+/* Bytes of medium chunks a background thread keeps zeroed for calloc */
+#define M_ZERO_POOL (-102)
+/* free() goes async from this size on (0 is never); bytes queued at most */
+#define M_FREE_ASYNC_THRESHOLD (-105)
+#define M_FREE_ASYNC_MAX (-106)
+/* Helper threads for zeroing and copying blocks of at least the threshold */
+#define M_PARALLEL_THREADS (-103)
+#define M_PARALLEL_THRESHOLD (-104)
+/* 
+ * Free-list order: by address, or most recently freed first so the next
+ * allocation of that size reuses a chunk still in cache.
+ */
+#define M_FREE_ORDER (-107)
+#define MALLOC_ORDER_ADDRESS 0
+#define MALLOC_ORDER_LIFO 1
+/* How a free chunk is picked; good-fit takes the best of the first few */
+#define M_PLACEMENT (-108)
+#define M_GOOD_FIT_COUNT (-109)
+#define MALLOC_FIT_FIRST 0
+#define MALLOC_FIT_NEXT 1
+#define MALLOC_FIT_BEST 2
+#define MALLOC_FIT_GOOD 3
+#define MALLOC_FIT_COUNT 4
+
+int mallopt(int param, int value) MALLOC_NOTHROW;
+/* 
+ * Return free memory to the arenas' backends, keeping 'pad' bytes free at
+ * the top of each. 1 if anything was released.
+ */
+int malloc_trim(size_t pad) MALLOC_NOTHROW;
+
+/* Free-list searches made under one placement policy. */
+struct malloc_fit_stats {
+    size_t searches;
+    /* Free nodes looked at, over all searches */
+    size_t visited;
+    /* Searches that found nothing and grew the heap */
+    size_t misses;
+};
+
+/* Blocks allocated under one tag and not yet freed, and their usable bytes */
+struct malloc_tag_stats {
+    size_t bytes;
+    size_t blocks;
+};
+
+struct malloc_stats {
+    struct malloc_fit_stats fit[MALLOC_FIT_COUNT];
+    /* 
+     * Each thread folds its counts in every few hundred KiB, so the tags
+     * trail other threads' recent allocations by that much.
+     */
+    struct malloc_tag_stats tags[MALLOC_TAG_COUNT];
+};
+
+void malloc_get_stats(struct malloc_stats *stats) MALLOC_NOTHROW;
+
+/* 
+ * Small size classes, served from a per-thread cache. Class 'c' hands out
+ * blocks of MALLOC_CLASS_SIZE(c) usable bytes; malloc_fixed.hpp picks the
+ * class at compile time.
+ */
+#define MALLOC_CLASS_COUNT 16
+#define MALLOC_CLASS_SIZE(c) (16 * ((size_t)(c) + 1))
+
+void* malloc_class(unsigned c) MALLOC_NOTHROW;
+void free_class(void *ptr, unsigned c) MALLOC_NOTHROW;
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
 
 #endif /*MALLOC_H*/
@@ -0,0 +1,105 @@
+#ifndef MALLOC_FIXED_HPP
+#define MALLOC_FIXED_HPP
+
+/*
+ * Allocation of sizes known at compile time. The size class is looked up in
+ * a constexpr table, so alloc_fixed<N>() is a direct malloc_class() call on
+ * the thread cache and free_fixed<N>() never reads the chunk header.
+ */
+
+#include <cstddef>
+#include <new>
+
+#include "malloc.h"
+
+namespace malloc_fixed {
+
+namespace detail {
+
+struct class_table {
+    std::size_t size[MALLOC_CLASS_COUNT];
+
+    constexpr class_table() : size()
+    {
+        for (unsigned c = 0; c < MALLOC_CLASS_COUNT; c++) {
+            size[c] = MALLOC_CLASS_SIZE(c);
+        }
+    }
+};
+
+constexpr class_table classes;
+
+/* The smallest class holding 'n' bytes, or MALLOC_CLASS_COUNT if none does. */
+constexpr unsigned class_of(std::size_t n)
+{
+    for (unsigned c = 0; c < MALLOC_CLASS_COUNT; c++) {
+        if (n <= classes.size[c]) {
+            return c;
+        }
+    }
+    return MALLOC_CLASS_COUNT;
+}
+
+} /* namespace detail */
+
+template<std::size_t N>
+constexpr unsigned size_class = detail::class_of(N);
+
+/* Returns NULL on failure, like malloc. */
+template<std::size_t N>
+inline void *alloc_fixed() noexcept
+{
+    if constexpr (size_class<N> < MALLOC_CLASS_COUNT) {
+        return malloc_class(size_class<N>);
+    } else {
+        return malloc(N);
+    }
+}
+
+template<std::size_t N>
+inline void free_fixed(void *ptr) noexcept
+{
+    if constexpr (size_class<N> < MALLOC_CLASS_COUNT) {
+        free_class(ptr, size_class<N>);
+    } else {
+        free_sized(ptr, N);
+    }
+}
+
+/*
+ * Mixin giving T a class-specific operator new/delete on its fixed size:
+ *
+ *     struct node : malloc_fixed::fixed_new<node> { ... };
+ *
+ * Classes derived from T with a different size fall back to the heap.
+ */
+template<class T>
+struct fixed_new {
+    static void *operator new(std::size_t size)
+    {
+        static_assert(alignof(T) <= MALLOC_CLASS_SIZE(0),
+            "over-aligned types need the aligned operator new");
+        void *ret;
+        while ((ret = size == sizeof(T) ? alloc_fixed<sizeof(T)>() : malloc(size)) == nullptr) {
+            std::new_handler handler = std::get_new_handler();
+            if (handler == nullptr) {
+                throw std::bad_alloc();
+            }
+            handler();
+        }
+        return ret;
+    }
+
+    static void operator delete(void *ptr, std::size_t size) noexcept
+    {
+        if (size == sizeof(T)) {
+            free_fixed<sizeof(T)>(ptr);
+        } else {
+            free_sized(ptr, size);
+        }
+    }
+};
+
+} /* namespace malloc_fixed */
+
+#endif /* MALLOC_FIXED_HPP */
@@ -0,0 +1,158 @@
+/*
+ * Replacements for every replaceable C++ allocation function. Each form
+ * goes straight to the matching entry point in malloc.c: aligned forms to
+ * aligned_alloc, sized deletes to free_sized/free_aligned_sized.
+ */
+
+#include <new>
+
+#include "malloc.h"
+
+/* Keep calling the new_handler until malloc succeeds or there is none. */
+static void *malloc_new(std::size_t size)
+{
+    void *ret;
+    while ((ret = malloc(size)) == nullptr) {
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+    return ret;
+}
+
+static void *malloc_new_aligned(std::size_t size, std::align_val_t al)
+{
+    void *ret;
+    while ((ret = aligned_alloc(static_cast<std::size_t>(al), size)) == nullptr) {
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+    return ret;
+}
+
+static void *malloc_new_nothrow(std::size_t size) noexcept
+{
+    try {
+        return malloc_new(size);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+static void *malloc_new_aligned_nothrow(std::size_t size, std::align_val_t al) noexcept
+{
+    try {
+        return malloc_new_aligned(size, al);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+/* Plain */
+
+void *operator new(std::size_t size)
+{
+    return malloc_new(size);
+}
+
+void *operator new[](std::size_t size)
+{
+    return malloc_new(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    return malloc_new_nothrow(size);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    return malloc_new_nothrow(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t&) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t&) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t size) noexcept
+{
+    free_sized(ptr, size);
+}
+
+void operator delete[](void *ptr, std::size_t size) noexcept
+{
+    free_sized(ptr, size);
+}
+
+/* Aligned */
+
+void *operator new(std::size_t size, std::align_val_t al)
+{
+    return malloc_new_aligned(size, al);
+}
+
+void *operator new[](std::size_t size, std::align_val_t al)
+{
+    return malloc_new_aligned(size, al);
+}
+
+void *operator new(std::size_t size, std::align_val_t al, const std::nothrow_t&) noexcept
+{
+    return malloc_new_aligned_nothrow(size, al);
+}
+
+void *operator new[](std::size_t size, std::align_val_t al, const std::nothrow_t&) noexcept
+{
+    return malloc_new_aligned_nothrow(size, al);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t size, std::align_val_t al) noexcept
+{
+    free_aligned_sized(ptr, static_cast<std::size_t>(al), size);
+}
+
+void operator delete[](void *ptr, std::size_t size, std::align_val_t al) noexcept
+{
+    free_aligned_sized(ptr, static_cast<std::size_t>(al), size);
+}
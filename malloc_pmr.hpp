@@ -0,0 +1,244 @@
+#ifndef MALLOC_PMR_HPP
+#define MALLOC_PMR_HPP
+
+/*
+ * std::pmr::memory_resource adapters over this allocator.
+ *
+ *  heap_resource   - the global heap; sized and aligned frees.
+ *  region_resource - bump allocation out of heap blocks, freed all at once.
+ *  pool_resource   - fixed-size blocks recycled through a free list.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <new>
+
+#include "malloc.h"
+
+namespace malloc_pmr {
+
+class heap_resource : public std::pmr::memory_resource {
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        void *ret = alignment <= alignof(std::max_align_t)
+            ? malloc(bytes) : aligned_alloc(alignment, bytes);
+        if (ret == nullptr) {
+            throw std::bad_alloc();
+        }
+        return ret;
+    }
+
+    void do_deallocate(void *ptr, std::size_t bytes, std::size_t alignment) override
+    {
+        if (alignment <= alignof(std::max_align_t)) {
+            free_sized(ptr, bytes);
+        } else {
+            free_aligned_sized(ptr, alignment, bytes);
+        }
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        /* There is one heap; any two of these can free each other's memory */
+        return dynamic_cast<const heap_resource*>(&other) != nullptr;
+    }
+};
+
+/* The process-wide heap resource. */
+inline heap_resource *heap()
+{
+    static heap_resource resource;
+    return &resource;
+}
+
+/*
+ * Hands out memory by bumping a pointer through blocks taken from the heap.
+ * Deallocation is a no-op; release() or the destructor returns every block.
+ */
+class region_resource : public std::pmr::memory_resource {
+public:
+    explicit region_resource(std::size_t block_size = 64 * 1024)
+        : block_size_(block_size) {}
+
+    region_resource(const region_resource&) = delete;
+    region_resource& operator=(const region_resource&) = delete;
+
+    ~region_resource() override
+    {
+        release();
+    }
+
+    void release() noexcept
+    {
+        while (blocks_ != nullptr) {
+            block *next = blocks_->next;
+            free_sized(blocks_, blocks_->size);
+            blocks_ = next;
+        }
+        cursor_ = end_ = nullptr;
+    }
+
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        char *start = align_up(cursor_, alignment);
+        if (start == nullptr || bytes > static_cast<std::size_t>(end_ - start)) {
+            grow(bytes + alignment);
+            start = align_up(cursor_, alignment);
+        }
+        cursor_ = start + bytes;
+        return start;
+    }
+
+    void do_deallocate(void *, std::size_t, std::size_t) override
+    {
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+
+private:
+    struct alignas(std::max_align_t) block {
+        block *next;
+        std::size_t size;
+    };
+
+    static char *align_up(char *ptr, std::size_t alignment)
+    {
+        std::uintptr_t addr = reinterpret_cast<std::uintptr_t>(ptr);
+        return ptr == nullptr ? nullptr : reinterpret_cast<char*>(
+            (addr + alignment - 1) & ~(static_cast<std::uintptr_t>(alignment) - 1));
+    }
+
+    void grow(std::size_t bytes)
+    {
+        std::size_t size = sizeof(block) + (bytes > block_size_ ? bytes : block_size_);
+        block *fresh = static_cast<block*>(malloc(size));
+        if (fresh == nullptr) {
+            throw std::bad_alloc();
+        }
+        fresh->next = blocks_;
+        fresh->size = size;
+        blocks_ = fresh;
+        cursor_ = reinterpret_cast<char*>(fresh + 1);
+        end_ = reinterpret_cast<char*>(fresh) + size;
+    }
+
+    std::size_t block_size_;
+    block *blocks_ = nullptr;
+    char *cursor_ = nullptr;
+    char *end_ = nullptr;
+};
+
+/*
+ * Fixed-size blocks carved from heap slabs. Requests that do not fit a
+ * block go to the heap with a sized free, so any container can use it.
+ */
+class pool_resource : public std::pmr::memory_resource {
+public:
+    explicit pool_resource(std::size_t block_size, std::size_t blocks_per_slab = 64)
+        : block_size_(round_block(block_size)), per_slab_(blocks_per_slab) {}
+
+    pool_resource(const pool_resource&) = delete;
+    pool_resource& operator=(const pool_resource&) = delete;
+
+    ~pool_resource() override
+    {
+        release();
+    }
+
+    void release() noexcept
+    {
+        while (slabs_ != nullptr) {
+            slab *next = slabs_->next;
+            free_sized(slabs_, sizeof(slab) + block_size_ * per_slab_);
+            slabs_ = next;
+        }
+        free_ = nullptr;
+    }
+
+    std::size_t block_size() const noexcept
+    {
+        return block_size_;
+    }
+
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        if (!fits(bytes, alignment)) {
+            return heap()->allocate(bytes, alignment);
+        }
+        if (free_ == nullptr) {
+            grow();
+        }
+        node *ret = free_;
+        free_ = ret->next;
+        return ret;
+    }
+
+    void do_deallocate(void *ptr, std::size_t bytes, std::size_t alignment) override
+    {
+        if (!fits(bytes, alignment)) {
+            heap()->deallocate(ptr, bytes, alignment);
+            return;
+        }
+        node *item = static_cast<node*>(ptr);
+        item->next = free_;
+        free_ = item;
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+
+private:
+    struct node {
+        node *next;
+    };
+
+    struct alignas(std::max_align_t) slab {
+        slab *next;
+    };
+
+    static std::size_t round_block(std::size_t size)
+    {
+        const std::size_t align = alignof(std::max_align_t);
+        size = size < sizeof(node) ? sizeof(node) : size;
+        return (size + align - 1) & ~(align - 1);
+    }
+
+    bool fits(std::size_t bytes, std::size_t alignment) const
+    {
+        return bytes <= block_size_ && alignment <= alignof(std::max_align_t);
+    }
+
+    void grow()
+    {
+        slab *fresh = static_cast<slab*>(malloc(sizeof(slab) + block_size_ * per_slab_));
+        if (fresh == nullptr) {
+            throw std::bad_alloc();
+        }
+        fresh->next = slabs_;
+        slabs_ = fresh;
+        char *item = reinterpret_cast<char*>(fresh + 1);
+        for (std::size_t i = 0; i < per_slab_; i++, item += block_size_) {
+            node *n = reinterpret_cast<node*>(item);
+            n->next = free_;
+            free_ = n;
+        }
+    }
+
+    std::size_t block_size_;
+    std::size_t per_slab_;
+    slab *slabs_ = nullptr;
+    node *free_ = nullptr;
+};
+
+} /* namespace malloc_pmr */
+
+#endif /* MALLOC_PMR_HPP */
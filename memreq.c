@@ -1,12 +1,298 @@
+#define _GNU_SOURCE
 #include "memreq.h"
 
+/* Huge pages the hugepage backend commits in; 2 MiB on x86-64 and arm64 */
+#define HUGEPAGE_SIZE ((size_t) 2 << 20)
+#define ROUNDUP_HUGE(x) (((uintptr_t) (x) + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1))
+#define ROUNDDOWN_HUGE(x) ((uintptr_t) (x) & ~(HUGEPAGE_SIZE - 1))
+
 #include <assert.h>
+#include <errno.h>
 #include <stddef.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/* Most of the break one sbrk arena reserves */
+#define SBRK_RESERVE ((size_t) 64 << 20)
+
+/* The break is one for the process: the sbrk heap and sbrk arenas move it in turn */
+static pthread_mutex_t sbrk_lock = PTHREAD_MUTEX_INITIALIZER;
 
 char* get_memory(unsigned n){
-    char *page = sbrk( (intptr_t) n);
+    char *page;
 
+    pthread_mutex_lock(&sbrk_lock);
+    page = sbrk( (intptr_t) n);
+    pthread_mutex_unlock(&sbrk_lock);
     return (page != (char*) -1 ? page : NULL);
 }
+
+char* map_memory(size_t n){
+    void *page = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    return (page != MAP_FAILED ? page : NULL);
+}
+
+void unmap_memory(char *start, size_t n){
+    munmap(start, n);
+}
+
+char* remap_memory(char *start, size_t old_n, size_t new_n, int may_move){
+    void *page = mremap(start, old_n, new_n, may_move ? MREMAP_MAYMOVE : 0);
+
+    return (page != MAP_FAILED ? page : NULL);
+}
+
+void purge_memory(char *start, size_t n){
+    #ifdef MADV_FREE
+    if (madvise(start, n, MADV_FREE) == 0 || errno != EINVAL)
+        return;
+    #endif /* MADV_FREE */
+    madvise(start, n, MADV_DONTNEED);
+}
+
+char* reserve_memory(size_t n){
+    void *page = mmap(NULL, n, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    return (page != MAP_FAILED ? page : NULL);
+}
+
+int commit_memory(char *start, size_t n){
+    return mprotect(start, n, PROT_READ | PROT_WRITE);
+}
+
+int decommit_memory(char *start, size_t n){
+    void *page = mmap(start, n, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+
+    return (page != MAP_FAILED ? 0 : -1);
+}
+
+char* map_file_memory(int fd, size_t n){
+    void *page = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    return (page != MAP_FAILED ? page : NULL);
+}
+
+int sync_memory(char *start, size_t n){
+    return msync(start, n, MS_SYNC);
+}
+
+int memfd_memory(size_t n){
+    int fd = memfd_create("malloc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    if (fd >= 0 && ftruncate(fd, n) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int tmpfile_memory(int dir, size_t n){
+    static unsigned serial = 0;
+    char name[64];
+    int fd = openat(dir, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+
+    if (fd < 0 && (EOPNOTSUPP == errno || EISDIR == errno)) {
+        /* No O_TMPFILE here: make a file and unlink it straight away */
+        snprintf(name, sizeof(name), ".malloc-%d-%u", (int) getpid(), __atomic_add_fetch(&serial, 1, __ATOMIC_RELAXED));
+        if ((fd = openat(dir, name, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0600)) >= 0) {
+            unlinkat(dir, name, 0);
+        }
+    }
+    if (fd >= 0 && ftruncate(fd, n) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int resize_file_memory(int fd, size_t n){
+    return ftruncate(fd, n);
+}
+
+char* map_file_memory_at(int fd, size_t n, char *at, int shared){
+    void *page = mmap(at, n, PROT_READ | PROT_WRITE, (shared ? MAP_SHARED : MAP_PRIVATE) | (at ? MAP_FIXED : 0), fd, 0);
+
+    return (page != MAP_FAILED ? page : NULL);
+}
+
+int seal_file_memory(int fd){
+    return fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_SHRINK);
+}
+
+/* The program break: all of a reservation is usable from the start */
+
+static char* sbrk_reserve(void *data, size_t *n){
+    if (*n > SBRK_RESERVE) {
+        *n = SBRK_RESERVE;
+    }
+    return get_memory(*n);
+}
+
+static int sbrk_commit(void *data, char *start, size_t n){
+    return 0;
+}
+
+static int sbrk_decommit(void *data, char *start, size_t n){
+    purge_memory(start, n);
+    return 0;
+}
+
+static void sbrk_purge(void *data, char *start, size_t n){
+    purge_memory(start, n);
+}
+
+static void sbrk_release(void *data, char *start, size_t n){
+    /* Only the top of the break can go back */
+    pthread_mutex_lock(&sbrk_lock);
+    if (start + n == sbrk(0)) {
+        sbrk(-(intptr_t) n);
+        start = NULL;
+    }
+    pthread_mutex_unlock(&sbrk_lock);
+    if (start != NULL) {
+        purge_memory(start, n);
+    }
+}
+
+const struct memreq_backend memreq_sbrk = {
+    sbrk_reserve, sbrk_commit, sbrk_decommit, sbrk_purge, sbrk_release, NULL
+};
+
+/* Anonymous mappings */
+
+static char* mmap_reserve(void *data, size_t *n){
+    return reserve_memory(*n);
+}
+
+static int mmap_commit(void *data, char *start, size_t n){
+    return commit_memory(start, n);
+}
+
+static int mmap_decommit(void *data, char *start, size_t n){
+    return decommit_memory(start, n);
+}
+
+static void mmap_purge(void *data, char *start, size_t n){
+    purge_memory(start, n);
+}
+
+static void mmap_release(void *data, char *start, size_t n){
+    unmap_memory(start, n);
+}
+
+const struct memreq_backend memreq_mmap = {
+    mmap_reserve, mmap_commit, mmap_decommit, mmap_purge, mmap_release, NULL
+};
+
+/* 
+ * Huge pages. Commits are rounded out to whole huge pages, so everything
+ * up to the next huge page boundary past a committed range is committed
+ * too; the next commit starts from that boundary.
+ */
+
+static char* hugepage_reserve(void *data, size_t *n){
+    size_t length = ROUNDUP_HUGE(*n) + HUGEPAGE_SIZE;
+    char *page = reserve_memory(length), *start;
+
+    if (NULL == page) {
+        return NULL;
+    }
+    /* Trim to a huge page boundary at both ends */
+    start = (char*) ROUNDUP_HUGE(page);
+    if (start != page) {
+        unmap_memory(page, start - page);
+    }
+    unmap_memory(start + ROUNDUP_HUGE(*n), page + length - (start + ROUNDUP_HUGE(*n)));
+    *n = ROUNDUP_HUGE(*n);
+    return start;
+}
+
+static int hugepage_commit(void *data, char *start, size_t n){
+    char *from = (char*) ROUNDUP_HUGE(start), *to = (char*) ROUNDUP_HUGE(start + n);
+    void *page;
+
+    if (from >= to) {
+        return 0;
+    }
+    /* Map from the pool first, then move it in, so a dry pool leaves the reservation be */
+    page = mmap(NULL, to - from, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (page != MAP_FAILED) {
+        if (mremap(page, to - from, to - from, MREMAP_MAYMOVE | MREMAP_FIXED, from) != MAP_FAILED) {
+            return 0;
+        }
+        munmap(page, to - from);
+    }
+    if (commit_memory(from, to - from) != 0) {
+        return -1;
+    }
+    madvise(from, to - from, MADV_HUGEPAGE);
+    return 0;
+}
+
+static int hugepage_decommit(void *data, char *start, size_t n){
+    char *from = (char*) ROUNDUP_HUGE(start), *to = (char*) ROUNDUP_HUGE(start + n);
+
+    return (from < to ? decommit_memory(from, to - from) : 0);
+}
+
+static void hugepage_purge(void *data, char *start, size_t n){
+    char *from = (char*) ROUNDUP_HUGE(start), *to = (char*) ROUNDDOWN_HUGE(start + n);
+
+    /* Huge pages go whole or not at all */
+    if (from < to) {
+        purge_memory(from, to - from);
+    }
+}
+
+const struct memreq_backend memreq_hugepage = {
+    hugepage_reserve, hugepage_commit, hugepage_decommit, hugepage_purge, mmap_release, NULL
+};
+
+/* A fixed buffer */
+
+static char* static_reserve(void *data, size_t *n){
+    struct memreq_region *region = data;
+    size_t used = (((uintptr_t) region->buffer + region->used + 15) & ~(uintptr_t) 15) - (uintptr_t) region->buffer;
+    char *start = region->buffer + used;
+
+    if (used >= region->size) {
+        return NULL;
+    }
+    if (*n > region->size - used) {
+        *n = region->size - used;
+    }
+    region->used = used + *n;
+    return start;
+}
+
+static int static_commit(void *data, char *start, size_t n){
+    return 0;
+}
+
+static void static_purge(void *data, char *start, size_t n){
+}
+
+static void static_release(void *data, char *start, size_t n){
+    struct memreq_region *region = data;
+
+    if (start + n == region->buffer + region->used) {
+        region->used = start - region->buffer;
+    }
+}
+
+void memreq_static(struct memreq_backend *backend, struct memreq_region *region, void *buffer, size_t size){
+    region->buffer = buffer;
+    region->size = size;
+    region->used = 0;
+    backend->reserve = static_reserve;
+    backend->commit = static_commit;
+    backend->decommit = static_commit;
+    backend->purge = static_purge;
+    backend->release = static_release;
+    backend->data = region;
+}
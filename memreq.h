@@ -1,6 +1,76 @@
 #ifndef MEMREQ_H
-#define MEMREQ_h
+#define MEMREQ_H
+
+#include <stddef.h>
 
 char* get_memory(unsigned amount);
 
+/* Anonymous mappings, for chunks kept outside the sbrk heap. */
+char* map_memory(size_t amount);
+void unmap_memory(char *start, size_t amount);
+/* Resize a mapping; it only moves if 'may_move' is set. NULL on failure. */
+char* remap_memory(char *start, size_t old_amount, size_t new_amount, int may_move);
+/* Let the kernel reclaim the pages lazily; contents become undefined. */
+void purge_memory(char *start, size_t amount);
+/* Reserve address space with no access; commit makes part of it usable, decommit undoes that. */
+char* reserve_memory(size_t amount);
+int commit_memory(char *start, size_t amount);
+int decommit_memory(char *start, size_t amount);
+/* Map 'amount' bytes of a file shared, read-write; write them back. */
+char* map_file_memory(int fd, size_t amount);
+int sync_memory(char *start, size_t amount);
+/* 
+ * An anonymous file of 'amount' bytes that can be sealed, or -1. Map it
+ * shared, or copy-on-write if not; a non-NULL 'at' replaces the pages there.
+ */
+int memfd_memory(size_t amount);
+int resize_file_memory(int fd, size_t amount);
+char* map_file_memory_at(int fd, size_t amount, char *at, int shared);
+/* An unlinked file of 'amount' bytes in the directory open as 'dir', or -1. */
+int tmpfile_memory(int dir, size_t amount);
+/* Forbid writes to the file; fails while anyone has it mapped writable and shared. */
+int seal_file_memory(int fd);
+
+/* 
+ * A memory backend for an arena (malloc_arena_create_backend). The arena
+ * reserves one range and commits it from the start up as it grows; it may
+ * decommit from the top or purge free pages in between on malloc_trim.
+ * Every hook gets 'data' first. Ranges passed back are page-aligned
+ * except where a backend's own reserve returned otherwise.
+ */
+struct memreq_backend {
+    /* Up to '*amount' bytes of address space; may lower '*amount'. NULL on failure */
+    char* (*reserve)(void *data, size_t *amount);
+    /* Make a reserved range usable, or give its memory back; 0 on success */
+    int (*commit)(void *data, char *start, size_t amount);
+    int (*decommit)(void *data, char *start, size_t amount);
+    /* The contents may be dropped; the range stays usable */
+    void (*purge)(void *data, char *start, size_t amount);
+    /* The whole range from reserve, which the arena no longer uses */
+    void (*release)(void *data, char *start, size_t amount);
+    void *data;
+};
+
+/* 
+ * Built-in backends: the program break (memory is usable from reserve
+ * on; at most 64 MiB per arena, taken under the same lock as get_memory),
+ * anonymous mappings, and huge pages from the hugetlb pool, falling
+ * back to transparent huge pages when the pool runs dry.
+ */
+extern const struct memreq_backend memreq_sbrk;
+extern const struct memreq_backend memreq_mmap;
+extern const struct memreq_backend memreq_hugepage;
+
+/* 
+ * A fixed buffer, such as static storage for arenas made before anything
+ * can be mapped. Each reserve takes what is left, up to what it asks.
+ */
+struct memreq_region {
+    char *buffer;
+    size_t size;
+    size_t used;
+};
+
+void memreq_static(struct memreq_backend *backend, struct memreq_region *region, void *buffer, size_t size);
+
 #endif /*MEMREQ_H*/
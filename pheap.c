@@ -0,0 +1,487 @@
+/*
+ * Persistent and shared heaps in a memory-mapped file. The layout follows
+ * the main heap: boundary-tagged chunks, an address-ordered first-fit free
+ * list and coalescing on free, except that every link is an offset from
+ * the start of the file.
+ *
+ *  0            header: magic, size, free list, roots, lock, named roots
+ *  PHEAP_DATA   start fence, then chunks (user data 16-byte aligned)
+ *  size - 8     end fence
+ *
+ * Any number of processes may have the file open. The lock in the header
+ * is process-shared and robust. Two byte-range locks on the file order
+ * opening and closing: byte 0 is held while a process attaches or
+ * detaches, byte 1 shared for as long as it is attached. Whoever finds
+ * byte 1 free is alone, so it may check the heap and set up the lock.
+ */
+
+#define _GNU_SOURCE
+#include "pheap.h"
+#include "memreq.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PHEAP_MAGIC 0x3230304150454850ULL /* "PHEAP002" */
+#define PHEAP_DATA 4096
+
+/* Bytes of the file locked to attach and detach */
+#define SETUP_BYTE 0
+#define ATTACH_BYTE 1
+
+#define FENCE_SIZE 8
+#define FENCE_OVERHEAD (2*FENCE_SIZE)
+#define NODE_OVERHEAD (sizeof(struct pnode)+FENCE_SIZE)
+#define ROUNDUP_16(x) (((((x)-1)>>4)+1)<<4)
+#define ROUNDUP_CHUNK(x) ROUNDUP_16(((x) < 16 ? 16 : (x))+FENCE_OVERHEAD)
+
+#define ISUSED(x) ((x) & 1)
+#define GETSIZE(x) ((x) & ~(uint64_t)15)
+
+/* The first chunk and the end fence */
+#define FIRST_CHUNK (PHEAP_DATA + FENCE_SIZE)
+#define END_FENCE(h) ((h)->size - FENCE_SIZE)
+
+/* Words and nodes at offsets into the mapping */
+#define WORD(h, off) (*(uint64_t*) ((h)->base + (off)))
+#define NODE(h, off) ((struct pnode*) ((h)->base + (off)))
+
+struct pheap_name {
+    char name[PHEAP_NAME_MAX];
+    uint64_t offset;
+};
+
+struct pheap_header {
+    uint64_t magic;
+    uint64_t size;
+    /* Cleared while open, set by the last pheap_close */
+    uint64_t clean;
+    /* Offset of the first free chunk, 0 if none */
+    uint64_t flist;
+    uint64_t roots[PHEAP_ROOTS];
+    pthread_mutex_t lock;
+    /* Named roots; an empty name is a free slot */
+    struct pheap_name names[PHEAP_NAMES];
+};
+
+_Static_assert(sizeof(struct pheap_header) <= PHEAP_DATA, "pheap header too large");
+
+/* A free chunk. 'size' is the whole chunk, like a fence. */
+struct pnode {
+    uint64_t size;
+    uint64_t prev;
+    uint64_t next;
+};
+
+struct pheap {
+    char *base;
+    size_t size;
+    int fd;
+};
+
+#define HEADER(h) ((struct pheap_header*) (h)->base)
+
+static void pheap_lock(pheap_t *heap)
+{
+    if (pthread_mutex_lock(&HEADER(heap)->lock) == EOWNERDEAD) {
+        /* 
+         * Its holder died. Whatever it was changing may be half done;
+         * pheap_check on the next lone open will say so.
+         */
+        HEADER(heap)->clean = 0;
+        pthread_mutex_consistent(&HEADER(heap)->lock);
+    }
+}
+
+static void pheap_unlock(pheap_t *heap)
+{
+    pthread_mutex_unlock(&HEADER(heap)->lock);
+}
+
+/* Lock one byte of the file, shared or not; 'wait' blocks until it can. */
+static int pheap_lock_byte(int fd, off_t byte, short type, int wait)
+{
+    struct flock range = { .l_type = type, .l_whence = SEEK_SET, .l_start = byte, .l_len = 1 };
+    return fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &range);
+}
+
+static void pheap_set_chunk(pheap_t *heap, uint64_t off, uint64_t size)
+{
+    WORD(heap, off) = size;
+    WORD(heap, off + GETSIZE(size) - FENCE_SIZE) = size;
+}
+
+/* Insert a free chunk into the address-ordered list. */
+static void pheap_list_insert(pheap_t *heap, uint64_t off)
+{
+    struct pheap_header *header = HEADER(heap);
+    uint64_t prev = 0, next = header->flist;
+
+    while (next != 0 && next < off) {
+        prev = next;
+        next = NODE(heap, next)->next;
+    }
+    NODE(heap, off)->prev = prev;
+    NODE(heap, off)->next = next;
+    if (prev != 0) {
+        NODE(heap, prev)->next = off;
+    } else {
+        header->flist = off;
+    }
+    if (next != 0) {
+        NODE(heap, next)->prev = off;
+    }
+}
+
+static void pheap_list_remove(pheap_t *heap, uint64_t off)
+{
+    struct pnode *node = NODE(heap, off);
+
+    if (node->prev != 0) {
+        NODE(heap, node->prev)->next = node->next;
+    } else {
+        HEADER(heap)->flist = node->next;
+    }
+    if (node->next != 0) {
+        NODE(heap, node->next)->prev = node->prev;
+    }
+}
+
+/* Lay out an empty heap over a freshly sized file. */
+static void pheap_format(pheap_t *heap)
+{
+    struct pheap_header *header = HEADER(heap);
+    unsigned i;
+
+    header->size = heap->size;
+    header->flist = 0;
+    for (i = 0; i < PHEAP_ROOTS; i++) {
+        header->roots[i] = 0;
+    }
+    for (i = 0; i < PHEAP_NAMES; i++) {
+        header->names[i].name[0] = '\0';
+        header->names[i].offset = 0;
+    }
+    WORD(heap, PHEAP_DATA) = 1;
+    WORD(heap, END_FENCE(heap)) = 1;
+    pheap_set_chunk(heap, FIRST_CHUNK, END_FENCE(heap) - FIRST_CHUNK);
+    pheap_list_insert(heap, FIRST_CHUNK);
+    header->magic = PHEAP_MAGIC;
+}
+
+/* Set up the heap for a process that has the file to itself. */
+static int pheap_attach_first(pheap_t *heap, int fresh, int flags)
+{
+    pthread_mutexattr_t attr;
+
+    if (fresh) {
+        pheap_format(heap);
+    } else if (HEADER(heap)->magic != PHEAP_MAGIC || HEADER(heap)->size != heap->size ||
+        ((!HEADER(heap)->clean || (flags & PHEAP_CHECK)) && pheap_check(heap) != 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* Whatever state a dead process left the lock in, nobody holds it now */
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&HEADER(heap)->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    /* An open heap counts as unclean until the last process closes it */
+    HEADER(heap)->clean = 0;
+    sync_memory(heap->base, PHEAP_DATA);
+    return 0;
+}
+
+pheap_t *pheap_open_fd(int fd, size_t size, int flags)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    struct stat st;
+    pheap_t *heap = NULL;
+    int fresh = 0, alone;
+
+    if (pheap_lock_byte(fd, SETUP_BYTE, F_WRLCK, 1) != 0 || fstat(fd, &st) != 0) {
+        goto fail;
+    }
+    if (0 == st.st_size && (flags & PHEAP_CREATE)) {
+        size = (size + page - 1) / page * page;
+        if (size < (size_t) page || ftruncate(fd, size) != 0) {
+            errno = size < (size_t) page ? EINVAL : errno;
+            goto fail;
+        }
+        fresh = 1;
+    } else {
+        size = st.st_size;
+    }
+    if (size < PHEAP_DATA + NODE_OVERHEAD + 2 * FENCE_SIZE || size % page != 0) {
+        errno = EINVAL;
+        goto fail;
+    }
+    if ((heap = malloc(sizeof(*heap))) == NULL) {
+        goto fail;
+    }
+    heap->size = size;
+    heap->fd = fd;
+    if ((heap->base = map_file_memory(fd, size)) == NULL) {
+        goto fail;
+    }
+
+    alone = 0 == pheap_lock_byte(fd, ATTACH_BYTE, F_WRLCK, 0);
+    if (alone ? pheap_attach_first(heap, fresh, flags) != 0 : HEADER(heap)->magic != PHEAP_MAGIC) {
+        errno = EINVAL;
+        unmap_memory(heap->base, size);
+        goto fail;
+    }
+    pheap_lock_byte(fd, ATTACH_BYTE, F_RDLCK, 1);
+    pheap_lock_byte(fd, SETUP_BYTE, F_UNLCK, 0);
+    return heap;
+
+fail:
+    free(heap);
+    close(fd);
+    return NULL;
+}
+
+pheap_t *pheap_open(const char *path, size_t size, int flags)
+{
+    int fd = open(path, O_RDWR | O_CLOEXEC | ((flags & PHEAP_CREATE) ? O_CREAT : 0), 0600);
+    return fd < 0 ? NULL : pheap_open_fd(fd, size, flags);
+}
+
+pheap_t *pheap_open_shm(const char *name, size_t size, int flags)
+{
+    int fd = shm_open(name, O_RDWR | O_CLOEXEC | ((flags & PHEAP_CREATE) ? O_CREAT : 0), 0600);
+    return fd < 0 ? NULL : pheap_open_fd(fd, size, flags);
+}
+
+int pheap_sync(pheap_t *heap)
+{
+    int ret;
+    pheap_lock(heap);
+    ret = sync_memory(heap->base, heap->size);
+    pheap_unlock(heap);
+    return ret;
+}
+
+int pheap_close(pheap_t *heap)
+{
+    int ret = 0;
+
+    if (NULL == heap) {
+        return 0;
+    }
+    pheap_lock_byte(heap->fd, SETUP_BYTE, F_WRLCK, 1);
+    if (0 == pheap_lock_byte(heap->fd, ATTACH_BYTE, F_WRLCK, 0)) {
+        /* Last one out: the data goes to the file before the clean mark */
+        ret = sync_memory(heap->base, heap->size);
+        if (0 == ret) {
+            HEADER(heap)->clean = 1;
+            ret = sync_memory(heap->base, PHEAP_DATA);
+        }
+    }
+    unmap_memory(heap->base, heap->size);
+    /* Closing the descriptor drops both byte locks */
+    close(heap->fd);
+    free(heap);
+    return ret;
+}
+
+void *pheap_alloc(pheap_t *heap, size_t size)
+{
+    uint64_t off, chunk, rest;
+
+    if (size > heap->size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size = ROUNDUP_CHUNK(size);
+    pheap_lock(heap);
+    for (off = HEADER(heap)->flist; off != 0 && NODE(heap, off)->size < size; off = NODE(heap, off)->next);
+    if (0 == off) {
+        pheap_unlock(heap);
+        errno = ENOMEM;
+        return NULL;
+    }
+    chunk = NODE(heap, off)->size;
+    if ((rest = chunk - size) >= NODE_OVERHEAD) {
+        /* The tail stays free and takes the chunk's place in the list */
+        pheap_set_chunk(heap, off + size, rest);
+        NODE(heap, off + size)->prev = NODE(heap, off)->prev;
+        NODE(heap, off + size)->next = NODE(heap, off)->next;
+        NODE(heap, off)->next = off + size;
+        if (NODE(heap, off + size)->next != 0) {
+            NODE(heap, NODE(heap, off + size)->next)->prev = off + size;
+        }
+        chunk = size;
+    }
+    pheap_list_remove(heap, off);
+    pheap_set_chunk(heap, off, chunk | 1);
+    pheap_unlock(heap);
+    return heap->base + off + FENCE_SIZE;
+}
+
+void pheap_free(pheap_t *heap, void *ptr)
+{
+    uint64_t off, size, prev, next;
+
+    if (NULL == ptr) {
+        return;
+    }
+    off = (char*) ptr - heap->base - FENCE_SIZE;
+    pheap_lock(heap);
+    size = GETSIZE(WORD(heap, off));
+
+    /* Absorb the free neighbors; the fences keep this inside the heap */
+    next = off + size;
+    if (!ISUSED(WORD(heap, next))) {
+        pheap_list_remove(heap, next);
+        size += WORD(heap, next);
+    }
+    if (!ISUSED(WORD(heap, off - FENCE_SIZE))) {
+        prev = off - WORD(heap, off - FENCE_SIZE);
+        pheap_set_chunk(heap, prev, WORD(heap, prev) + size);
+    } else {
+        pheap_set_chunk(heap, off, size);
+        pheap_list_insert(heap, off);
+    }
+    pheap_unlock(heap);
+}
+
+uint64_t pheap_offset(pheap_t *heap, const void *ptr)
+{
+    return NULL == ptr ? 0 : (uint64_t) ((const char*) ptr - heap->base);
+}
+
+void *pheap_ptr(pheap_t *heap, uint64_t offset)
+{
+    return 0 == offset ? NULL : heap->base + offset;
+}
+
+int pheap_set_root(pheap_t *heap, unsigned slot, void *ptr)
+{
+    if (slot >= PHEAP_ROOTS) {
+        errno = EINVAL;
+        return -1;
+    }
+    __atomic_store_n(&HEADER(heap)->roots[slot], pheap_offset(heap, ptr), __ATOMIC_RELEASE);
+    return 0;
+}
+
+void *pheap_root(pheap_t *heap, unsigned slot)
+{
+    if (slot >= PHEAP_ROOTS) {
+        return NULL;
+    }
+    return pheap_ptr(heap, __atomic_load_n(&HEADER(heap)->roots[slot], __ATOMIC_ACQUIRE));
+}
+
+/* The slot holding 'name', or with 'empty' set, a free slot if it has none. */
+static struct pheap_name *pheap_find_name(pheap_t *heap, const char *name, int empty)
+{
+    struct pheap_name *names = HEADER(heap)->names, *free_slot = NULL;
+    unsigned i;
+
+    for (i = 0; i < PHEAP_NAMES; i++) {
+        if (strncmp(names[i].name, name, PHEAP_NAME_MAX) == 0) {
+            return &names[i];
+        }
+        if (NULL == free_slot && '\0' == names[i].name[0]) {
+            free_slot = &names[i];
+        }
+    }
+    return empty ? free_slot : NULL;
+}
+
+int pheap_set_named(pheap_t *heap, const char *name, void *ptr)
+{
+    struct pheap_name *slot;
+    int ret = 0;
+
+    if ('\0' == name[0] || strlen(name) >= PHEAP_NAME_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    pheap_lock(heap);
+    if ((slot = pheap_find_name(heap, name, NULL != ptr)) == NULL) {
+        /* Nothing to remove, or no room to add */
+        if (ptr != NULL) {
+            errno = ENOSPC;
+            ret = -1;
+        }
+    } else if (NULL == ptr) {
+        slot->name[0] = '\0';
+        slot->offset = 0;
+    } else {
+        slot->offset = pheap_offset(heap, ptr);
+        strncpy(slot->name, name, PHEAP_NAME_MAX);
+    }
+    pheap_unlock(heap);
+    return ret;
+}
+
+void *pheap_named(pheap_t *heap, const char *name)
+{
+    struct pheap_name *slot;
+    void *ret;
+
+    pheap_lock(heap);
+    slot = pheap_find_name(heap, name, 0);
+    ret = NULL == slot ? NULL : pheap_ptr(heap, slot->offset);
+    pheap_unlock(heap);
+    return ret;
+}
+
+/*
+ * Walk the chunks from fence to fence, then the free list, and make sure
+ * they agree: matching header and footer, no two free chunks in a row,
+ * every free chunk listed once in address order, roots on used chunks.
+ * Only meaningful while no other process is changing the heap.
+ */
+int pheap_check(pheap_t *heap)
+{
+    struct pheap_header *header = HEADER(heap);
+    uint64_t off, size, prev = 0, frees = 0, listed = 0, root;
+    int last_free = 0;
+    unsigned i;
+
+    if (WORD(heap, PHEAP_DATA) != 1 || WORD(heap, END_FENCE(heap)) != 1) {
+        return -1;
+    }
+    for (off = FIRST_CHUNK; off != END_FENCE(heap); off += size) {
+        size = GETSIZE(WORD(heap, off));
+        if (size < NODE_OVERHEAD || (WORD(heap, off) & 14) != 0 ||
+            size > END_FENCE(heap) - off ||
+            WORD(heap, off + size - FENCE_SIZE) != WORD(heap, off) ||
+            (last_free && !ISUSED(WORD(heap, off)))) {
+            return -1;
+        }
+        last_free = !ISUSED(WORD(heap, off));
+        frees += last_free;
+    }
+    for (off = header->flist; off != 0; prev = off, off = NODE(heap, off)->next) {
+        if (off <= prev || off < FIRST_CHUNK || off >= END_FENCE(heap) || off % 16 != 8 ||
+            ISUSED(WORD(heap, off)) || NODE(heap, off)->prev != prev || ++listed > frees) {
+            return -1;
+        }
+    }
+    if (listed != frees) {
+        return -1;
+    }
+    for (i = 0; i < PHEAP_ROOTS + PHEAP_NAMES; i++) {
+        root = i < PHEAP_ROOTS ? header->roots[i] : header->names[i - PHEAP_ROOTS].offset;
+        if (0 == root) {
+            continue;
+        }
+        off = root - FENCE_SIZE;
+        if (root < FIRST_CHUNK + FENCE_SIZE || root >= END_FENCE(heap) || off % 16 != 8 ||
+            !ISUSED(WORD(heap, off))) {
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,75 @@
+#ifndef PHEAP_H
+#define PHEAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "malloc.h"
+
+/*
+ * A heap kept in a memory-mapped file. Chunk headers, the free list and a
+ * table of root offsets all live in the file and link by offset from its
+ * start, so opening the file again, at whatever address, brings back
+ * every allocation. Keep offsets, not pointers, inside heap data.
+ *
+ * Several processes can have one heap open at once, over a file, shared
+ * memory from shm_open or a memfd: a block allocated in one can be read
+ * or freed in another without a copy. A process attaches by opening the
+ * heap itself; a handle inherited across fork works, but only one side
+ * may pheap_close it.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#define PHEAP_ROOTS 64
+/* Named roots, and the longest name plus its terminator */
+#define PHEAP_NAMES 48
+#define PHEAP_NAME_MAX 56
+
+/* pheap_open flags */
+/* Make the file, 'size' bytes rounded to pages, if it does not exist */
+#define PHEAP_CREATE 1
+/* Check every chunk on open, not only after an unclean close */
+#define PHEAP_CHECK 2
+
+typedef struct pheap pheap_t;
+
+/* 
+ * NULL with errno set on failure; EINVAL if the file fails the check.
+ * pheap_open_fd takes over 'fd', which may come from memfd_create; the
+ * others open 'path' or the shm_open object 'name' for it.
+ */
+pheap_t* pheap_open(const char *path, size_t size, int flags) MALLOC_NOTHROW;
+pheap_t* pheap_open_shm(const char *name, size_t size, int flags) MALLOC_NOTHROW;
+pheap_t* pheap_open_fd(int fd, size_t size, int flags) MALLOC_NOTHROW;
+/* 
+ * Detach. The last process to close writes everything back and marks the
+ * file clean. 0, or -1 with errno.
+ */
+int pheap_close(pheap_t *heap) MALLOC_NOTHROW;
+int pheap_sync(pheap_t *heap) MALLOC_NOTHROW;
+
+void* pheap_alloc(pheap_t *heap, size_t size) MALLOC_NOTHROW;
+void pheap_free(pheap_t *heap, void *ptr) MALLOC_NOTHROW;
+
+/* Offset 0 stands for NULL. */
+uint64_t pheap_offset(pheap_t *heap, const void *ptr) MALLOC_NOTHROW;
+void* pheap_ptr(pheap_t *heap, uint64_t offset) MALLOC_NOTHROW;
+
+/* Named entry points into the heap's data, kept across opens. */
+int pheap_set_root(pheap_t *heap, unsigned slot, void *ptr) MALLOC_NOTHROW;
+void* pheap_root(pheap_t *heap, unsigned slot) MALLOC_NOTHROW;
+/* The same by name; a NULL 'ptr' removes the name. -1 with ENOSPC if full. */
+int pheap_set_named(pheap_t *heap, const char *name, void *ptr) MALLOC_NOTHROW;
+void* pheap_named(pheap_t *heap, const char *name) MALLOC_NOTHROW;
+
+/* Walk every chunk and the free list. 0 if consistent, else -1. */
+int pheap_check(pheap_t *heap) MALLOC_NOTHROW;
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* PHEAP_H */
@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "pheap.h"
+
+#define NUM_NODES 1000
+#define NUM_CHURN 20000
+
+/* A list kept in the heap file, linked by offset */
+struct item {
+    uint64_t next;
+    int value;
+};
+
+int main() {
+    char path[] = "/tmp/pheapXXXXXX";
+    pheap_t *heap;
+    struct item *item;
+    uint64_t head = 0;
+    char *message;
+    int fd, i, status;
+    pid_t child;
+
+    if ((fd = mkstemp(path)) < 0) {
+        return 1;
+    }
+    close(fd);
+    unlink(path);
+
+    heap = pheap_open(path, 1 << 20, PHEAP_CREATE);
+    if (heap == NULL) {
+        printf("Could not create the heap file\n");
+        return 1;
+    }
+    for(i = 0; i < NUM_NODES; i++){
+        item = pheap_alloc(heap, sizeof(*item) + i % 100);
+        item->value = i;
+        item->next = head;
+        head = pheap_offset(heap, item);
+        /* Churn so the free list has something in it */
+        pheap_free(heap, pheap_alloc(heap, 200));
+    }
+    pheap_set_root(heap, 0, pheap_ptr(heap, head));
+    if (pheap_close(heap) != 0) {
+        printf("Could not close the heap\n");
+        return 1;
+    }
+
+    /* Reopen, checked, and find the list again from its root */
+    heap = pheap_open(path, 0, PHEAP_CHECK);
+    if (heap == NULL) {
+        printf("Could not reopen the heap\n");
+        return 1;
+    }
+    for(i = NUM_NODES - 1, item = pheap_root(heap, 0); item != NULL; i--){
+        if (item->value != i) {
+            printf("Heap lost item %d\n", i);
+            return 1;
+        }
+        head = item->next;
+        if (i % 2) {
+            pheap_free(heap, item);
+        }
+        item = pheap_ptr(heap, head);
+    }
+    pheap_set_root(heap, 0, NULL);
+    if (i != -1 || pheap_check(heap) != 0) {
+        printf("Heap inconsistent after reopening\n");
+        return 1;
+    }
+
+    /* A clobbered chunk header is caught when the file is next opened */
+    item = pheap_alloc(heap, 64);
+    ((uint64_t*) item)[-1] = 12345;
+    pheap_close(heap);
+    if (pheap_open(path, 0, PHEAP_CHECK) != NULL) {
+        printf("Corrupt heap opened\n");
+        return 1;
+    }
+
+    unlink(path);
+
+    /* Two processes share one heap over a memfd, both allocating at once */
+    if ((fd = memfd_create("test10", MFD_CLOEXEC)) < 0 ||
+        (heap = pheap_open_fd(fd, 1 << 20, PHEAP_CREATE)) == NULL) {
+        printf("Could not create the shared heap\n");
+        return 1;
+    }
+    if ((child = fork()) == 0) {
+        for(i = 0; i < NUM_CHURN; i++){
+            pheap_free(heap, pheap_alloc(heap, 16 + i % 500));
+        }
+        message = pheap_alloc(heap, 64);
+        strcpy(message, "from the child");
+        _exit(pheap_set_named(heap, "message", message) != 0);
+    }
+    for(i = 0; i < NUM_CHURN; i++){
+        pheap_free(heap, pheap_alloc(heap, 16 + i % 300));
+    }
+    if (waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("Shared heap child failed\n");
+        return 1;
+    }
+    message = pheap_named(heap, "message");
+    if (message == NULL || strcmp(message, "from the child") != 0) {
+        printf("Named root not shared\n");
+        return 1;
+    }
+    pheap_free(heap, message);
+    pheap_set_named(heap, "message", NULL);
+    if (pheap_named(heap, "message") != NULL || pheap_check(heap) != 0) {
+        printf("Shared heap inconsistent\n");
+        return 1;
+    }
+    pheap_close(heap);
+    return 0;
+}
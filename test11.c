@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "iobuf.h"
+
+#define NUM_THREADS 4
+#define NUM_ROUNDS 20000
+
+static size_t registered = 0;
+
+static void count_slab(void *start, size_t size, void *arg)
+{
+    registered += size;
+}
+
+static void *churn(void *arg)
+{
+    size_t seed = (size_t) arg, size;
+    char *bufs[8] = { NULL };
+    int i, j;
+
+    for(i = 0; i < NUM_ROUNDS; i++){
+        j = i % 8;
+        iobuf_free(bufs[j]);
+        seed = seed * 6364136223846793005ULL + 1;
+        size = (seed >> 33) % (256 * 1024) + 1;
+        if ((bufs[j] = iobuf_alloc(size)) == NULL || iobuf_size(bufs[j]) < size) {
+            return (void*) 1;
+        }
+        memset(bufs[j], j, size);
+    }
+    for(j = 0; j < 8; j++){
+        iobuf_free(bufs[j]);
+    }
+    return NULL;
+}
+
+int main() {
+    long page = sysconf(_SC_PAGESIZE);
+    pthread_t threads[NUM_THREADS];
+    void *ret;
+    char *a, *b;
+    int i;
+
+    if (iobuf_configure(0, NULL, count_slab, NULL) != 0) {
+        printf("Could not configure the pool\n");
+        return 1;
+    }
+    a = iobuf_alloc(1);
+    if (a == NULL || (uintptr_t) a % page != 0 || iobuf_size(a) != (size_t) page || registered == 0) {
+        printf("Bad first buffer\n");
+        return 1;
+    }
+    if (iobuf_configure(0, NULL, NULL, NULL) != -1 || iobuf_alloc(0) != NULL || 
+        iobuf_alloc((size_t) page << IOBUF_CLASSES) != NULL) {
+        printf("Pool accepted a bad request\n");
+        return 1;
+    }
+    /* The buffer just freed is the next one handed out */
+    iobuf_free(a);
+    b = iobuf_alloc(page);
+    if (b != a) {
+        printf("Freed buffer not reused first\n");
+        return 1;
+    }
+    iobuf_free(b);
+
+    for(i = 0; i < NUM_THREADS; i++){
+        pthread_create(&threads[i], NULL, churn, (void*) (size_t) (i + 1));
+    }
+    for(i = 0; i < NUM_THREADS; i++){
+        pthread_join(threads[i], &ret);
+        if (ret != NULL) {
+            printf("Thread got a bad buffer\n");
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,36 @@
+#include <cstdio>
+#include <cstdint>
+#include <new>
+
+struct alignas(64) Line {
+    char bytes[64];
+};
+
+int main() {
+    int i;
+    int *ints[100];
+    Line *lines[100];
+
+    for (i = 0; i < 100; i++) {
+        ints[i] = new int[i + 1];
+        ints[i][i] = i;
+        lines[i] = new Line;
+        if ((uintptr_t) lines[i] % 64 != 0) {
+            printf("Misaligned Line at %p\n", (void*) lines[i]);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < 100; i++) {
+        delete[] ints[i];
+        delete lines[i];
+    }
+
+    size_t huge = (size_t) -1 / 2;
+    if (new (std::nothrow) char[huge] != nullptr) {
+        printf("Huge nothrow new succeeded\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,59 @@
+#include <cstdio>
+#include <vector>
+#include <list>
+#include <string>
+
+#include "malloc_pmr.hpp"
+#include "malloc_fixed.hpp"
+
+struct node : malloc_fixed::fixed_new<node> {
+    node *next;
+    long value;
+};
+
+int main() {
+    int i;
+    malloc_pmr::region_resource region;
+    malloc_pmr::pool_resource pool(48);
+
+    std::pmr::vector<std::pmr::string> words(malloc_pmr::heap());
+    std::pmr::vector<int> scratch(&region);
+    std::pmr::list<int> nodes(&pool);
+
+    for (i = 0; i < 5000; i++) {
+        words.emplace_back(std::to_string(i) + " is a long enough string to spill");
+        scratch.push_back(i);
+        nodes.push_back(i);
+    }
+    for (i = 0; i < 5000; i++) {
+        if (scratch[i] != i || nodes.front() != i) {
+            printf("Lost value %d\n", i);
+            return 1;
+        }
+        nodes.pop_front();
+    }
+
+    node *head = nullptr;
+    for (i = 0; i < 5000; i++) {
+        node *item = new node;
+        item->next = head;
+        item->value = i;
+        head = item;
+    }
+    while (head != nullptr) {
+        node *next = head->next;
+        delete head;
+        head = next;
+    }
+
+    void *small = malloc_fixed::alloc_fixed<24>();
+    void *large = malloc_fixed::alloc_fixed<1000>();
+    if (small == nullptr || large == nullptr) {
+        printf("alloc_fixed failed\n");
+        return 1;
+    }
+    malloc_fixed::free_fixed<24>(small);
+    malloc_fixed::free_fixed<1000>(large);
+
+    return 0;
+}
@@ -0,0 +1,729 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "malloc.h"
+#include "memreq.h"
+
+#define NUM_MALLOCS 5000
+
+/* One function per feature; each frees what it allocates and resets its tunables */
+static char* ptrs[NUM_MALLOCS];
+
+/* Early-startup memory for an arena */
+static char region_buffer[4 << 20];
+
+static int hooked = 0;
+
+static void count_hook(unsigned tag, size_t bytes, void *arg)
+{
+    (void) tag;
+    (void) bytes;
+    (*(int*) arg)++;
+}
+
+static int test_good_size(void)
+{
+    size_t good;
+    int i;
+
+    for(i = 0; i < NUM_MALLOCS; i++){
+        good = malloc_good_size(i);
+        if (good < (size_t) i || nallocx(i, MALLOCX_ALIGN(64)) != good) {
+            printf("Bad good size %zu for %d\n", good, i);
+            return 1;
+        }
+        ptrs[i] = (char*) malloc(good);
+        if (malloc_usable_size(ptrs[i]) < good) {
+            printf("Usable size %zu below good size %zu\n", malloc_usable_size(ptrs[i]), good);
+            return 1;
+        }
+        ptrs[i][good - 1] = 1;
+    }
+    for(i = 0; i < NUM_MALLOCS; i++){
+        free(ptrs[i]);
+    }
+    return 0;
+}
+
+static int test_allocx(void)
+{
+    size_t good;
+    int i;
+
+    for(i = 0; i < NUM_MALLOCS; i++){
+        ptrs[i] = (char*) malloc(malloc_good_size(i));
+    }
+    /* Free every other block so its neighbor can grow into it */
+    for(i = 1; i < NUM_MALLOCS; i += 2) {
+        free(ptrs[i]);
+        ptrs[i] = NULL;
+    }
+    for(i = 0; i < NUM_MALLOCS; i += 2) {
+        good = malloc_usable_size(ptrs[i]);
+        ptrs[i][0] = 42;
+        if (xallocx(ptrs[i], good + 16, 0, MALLOCX_ZERO) >= good + 16) {
+            if (ptrs[i][0] != 42 || ptrs[i][good + 15] != 0) {
+                printf("xallocx lost or did not zero data\n");
+                return 1;
+            }
+        }
+        good = malloc_usable_size(ptrs[i]);
+        if (good >= 64 && xallocx(ptrs[i], 1, 0, 0) >= good) {
+            printf("xallocx did not shrink\n");
+            return 1;
+        }
+        ptrs[i] = rallocx(ptrs[i], 4 * good + 1, MALLOCX_ALIGN(64));
+        if (ptrs[i] == NULL || (size_t) ptrs[i] % 64 != 0 || ptrs[i][0] != 42) {
+            printf("rallocx failed\n");
+            return 1;
+        }
+    }
+    for(i = 0; i < NUM_MALLOCS; i++) {
+        dallocx(ptrs[i], MALLOCX_TCACHE_NONE);
+    }
+    /* Same size, stricter alignment: the block has to move */
+    ptrs[0] = malloc(100);
+    while ((size_t) ptrs[0] % 4096 == 0) {
+        ptrs[1] = ptrs[0];
+        ptrs[0] = malloc(100);
+        free(ptrs[1]);
+    }
+    ptrs[0][0] = 42;
+    ptrs[0] = rallocx(ptrs[0], malloc_usable_size(ptrs[0]), MALLOCX_ALIGN(4096));
+    if (ptrs[0] == NULL || (size_t) ptrs[0] % 4096 != 0 || ptrs[0][0] != 42) {
+        printf("rallocx kept a misaligned block\n");
+        return 1;
+    }
+    dallocx(ptrs[0], 0);
+    return 0;
+}
+
+static int test_realloc_used(void)
+{
+    int i;
+
+    for(i = 0; i < NUM_MALLOCS; i++){
+        ptrs[i] = malloc(i);
+        ptrs[i][0] = 42;
+    }
+    for(i = 0; i < NUM_MALLOCS; i++) {
+        ptrs[i] = realloc_used(ptrs[i], 64 * (i + 1), 1);
+        if (ptrs[i] == NULL || ptrs[i][0] != 42) {
+            printf("realloc_used lost the used bytes\n");
+            return 1;
+        }
+    }
+    for(i = 0; i < NUM_MALLOCS; i++) {
+        free(ptrs[i]);
+    }
+    return 0;
+}
+
+/* A block realloc keeps growing gets half again as much room; a one-off does not */
+static int test_grow_headroom(void)
+{
+    size_t size, usable;
+    int grows = 0;
+
+    ptrs[0] = malloc(5000);
+    ptrs[0] = realloc(ptrs[0], 10000);
+    if (malloc_usable_size(ptrs[0]) >= 15000) {
+        printf("A single realloc got headroom\n");
+        return 1;
+    }
+    free(ptrs[0]);
+
+    /* A new block at a grown one's address does not carry on its streak */
+    ptrs[0] = realloc(realloc(malloc(5000), 6000), 7000);
+    free(ptrs[0]);
+    ptrs[1] = malloc(5000);
+    if (ptrs[1] == ptrs[0] && malloc_usable_size(ptrs[1] = realloc(ptrs[1], 10000)) >= 15000) {
+        printf("A reused address inherited a growth streak\n");
+        return 1;
+    }
+    free(ptrs[1]);
+
+    ptrs[0] = malloc(5000);
+    usable = malloc_usable_size(ptrs[0]);
+    for(size = 6000; size <= 100000; size += 1000){
+        ptrs[0] = realloc(ptrs[0], size);
+        if (malloc_usable_size(ptrs[0]) != usable) {
+            usable = malloc_usable_size(ptrs[0]);
+            grows++;
+            /* From the third growth in a row on, each one leaves headroom */
+            if (grows >= 3 && usable < size + size / 2) {
+                printf("Growth %d to %zu got only %zu bytes\n", grows, size, usable);
+                return 1;
+            }
+        }
+    }
+    /* 95 appends: geometric growth takes about log1.5(20) of them */
+    if (grows > 15) {
+        printf("Append loop grew the block %d times\n", grows);
+        return 1;
+    }
+    free(ptrs[0]);
+    return 0;
+}
+
+/* Let the zeroing worker recycle what calloc hands out */
+static int test_zero_pool(void)
+{
+    size_t j;
+    int i;
+
+    mallopt(M_ZERO_POOL, 1 << 20);
+    for(i = 0; i < NUM_MALLOCS; i++){
+        ptrs[i % 8] = calloc(1000 + i % 4000, 1);
+        for (j = 0; j < 1000 + i % 4000; j++) {
+            if (ptrs[i % 8][j] != 0) {
+                printf("calloc returned dirty memory\n");
+                return 1;
+            }
+        }
+        ptrs[i % 8][0] = 1;
+        ptrs[i % 8][999] = 1;
+        if (i % 8 == 7) {
+            for (j = 0; j < 8; j++) {
+                free(ptrs[j]);
+            }
+        }
+    }
+    mallopt(M_ZERO_POOL, 0);
+    return 0;
+}
+
+/* Split zeroing and copying of reused 8 MB mappings over helpers */
+static int test_parallel(void)
+{
+    size_t j;
+    int i;
+
+    mallopt(M_PARALLEL_THREADS, 3);
+    mallopt(M_PARALLEL_THRESHOLD, 1 << 20);
+    for(i = 0; i < 8; i++){
+        ptrs[0] = calloc(8 << 20, 1);
+        for (j = 0; j < (8 << 20); j += 512) {
+            if (ptrs[0][j] != 0) {
+                printf("parallel calloc left dirty memory\n");
+                return 1;
+            }
+            ptrs[0][j] = 1;
+        }
+        ptrs[1] = mallocx(16 << 20, MALLOCX_ALIGN(1 << 16));
+        ptrs[1] = rallocx(ptrs[1], 8 << 20, 0);
+        ptrs[0] = rallocx(ptrs[0], 12 << 20, MALLOCX_ALIGN(1 << 16));
+        if (ptrs[0][8 << 19] != 1) {
+            printf("parallel copy lost data\n");
+            return 1;
+        }
+        free(ptrs[0]);
+        free(ptrs[1]);
+    }
+    mallopt(M_PARALLEL_THREADS, 0);
+    return 0;
+}
+
+/* Queue large frees to the reclaimer, more than it may hold at once */
+static int test_free_async(void)
+{
+    int i;
+
+    mallopt(M_FREE_ASYNC_THRESHOLD, 1 << 20);
+    mallopt(M_FREE_ASYNC_MAX, 8 << 20);
+    for(i = 0; i < 64; i++){
+        ptrs[i] = malloc((2 << 20) + i);
+        ptrs[i][0] = 1;
+    }
+    for(i = 0; i < 64; i++){
+        if (i % 2) {
+            free(ptrs[i]);
+        } else {
+            free_async(ptrs[i]);
+        }
+    }
+    mallopt(M_FREE_ASYNC_THRESHOLD, 0);
+    return 0;
+}
+
+/* Deferred chunks must stay intact while a read section is open */
+static int test_deferred(void)
+{
+    int i;
+
+    malloc_epoch_enter();
+    for(i = 0; i < NUM_MALLOCS; i++){
+        ptrs[i] = malloc(24);
+        ptrs[i][23] = 7;
+        free_deferred(ptrs[i]);
+    }
+    for(i = 0; i < NUM_MALLOCS; i++){
+        if (ptrs[i][23] != 7) {
+            printf("Deferred chunk freed inside a read section\n");
+            return 1;
+        }
+    }
+    malloc_epoch_exit();
+    for(i = 0; i < NUM_MALLOCS; i++){
+        free_deferred(malloc(24));
+    }
+    return 0;
+}
+
+/* Hinted blocks share a page only with blocks of the same lifetime */
+static int test_hint(void)
+{
+    int i;
+
+    for(i = 0; i < NUM_MALLOCS; i++){
+        ptrs[i] = malloc_hint(40, i % 2 ? MALLOC_SHORT_LIVED : MALLOC_LONG_LIVED);
+        ptrs[i][39] = 3;
+    }
+    for(i = 2; i < NUM_MALLOCS; i++){
+        if ((((size_t) ptrs[i] ^ (size_t) ptrs[i - 1]) >> 20) == 0) {
+            printf("Short- and long-lived blocks share a region\n");
+            return 1;
+        }
+    }
+    for(i = 0; i < NUM_MALLOCS; i++){
+        ptrs[i] = realloc(ptrs[i], 400);
+        if (ptrs[i][39] != 3) {
+            printf("realloc lost a hinted block's data\n");
+            return 1;
+        }
+        free(ptrs[i]);
+    }
+    return 0;
+}
+
+/* Size classes live in their own region, away from medium chunks */
+static int test_size_classes(void)
+{
+    ptrs[0] = malloc(32);
+    ptrs[1] = malloc(4000);
+    if ((((size_t) ptrs[0] ^ (size_t) ptrs[1]) >> 20) == 0) {
+        printf("Small and medium blocks share a region\n");
+        return 1;
+    }
+    /* A small block grown to medium size moves out of the classes' region */
+    ptrs[2] = malloc(100);
+    ptrs[3] = malloc(100);
+    free(ptrs[3]);
+    ptrs[2] = realloc(ptrs[2], 4000);
+    if ((((size_t) ptrs[0] ^ (size_t) ptrs[2]) >> 20) == 0) {
+        printf("Grown block stayed among the size classes\n");
+        return 1;
+    }
+    free(ptrs[0]);
+    free(ptrs[1]);
+    free(ptrs[2]);
+    return 0;
+}
+
+/* Every placement policy serves the same churn and counts its searches */
+static int test_placement(void)
+{
+    struct malloc_stats before, after;
+    int i, j;
+
+    for(i = 0; i < MALLOC_FIT_COUNT; i++){
+        malloc_get_stats(&before);
+        mallopt(M_PLACEMENT, i);
+        for(j = 0; j < NUM_MALLOCS; j++){
+            ptrs[j] = malloc(300 + (j * 37) % 2000);
+            ptrs[j][299] = (char) j;
+            if (j % 3 == 0) {
+                free(ptrs[j / 2]);
+                ptrs[j / 2] = malloc(300);
+            }
+        }
+        for(j = 0; j < NUM_MALLOCS; j++){
+            free(ptrs[j]);
+        }
+        malloc_get_stats(&after);
+        if (after.fit[i].searches <= before.fit[i].searches ||
+            after.fit[i].visited < after.fit[i].searches - after.fit[i].misses) {
+            printf("Placement policy %d kept no statistics\n", i);
+            return 1;
+        }
+    }
+    mallopt(M_PLACEMENT, MALLOC_FIT_FIRST);
+    return 0;
+}
+
+static int test_arenas(void)
+{
+    int i;
+
+    if (mallocx(16, MALLOCX_ARENA(15)) != NULL) {
+        printf("mallocx accepted an unknown arena\n");
+        return 1;
+    }
+    i = malloc_arena_create();
+    ptrs[0] = mallocx(100, MALLOCX_ARENA(i) | MALLOCX_ALIGN(256));
+    if (i <= 0 || ptrs[0] == NULL || (size_t) ptrs[0] % 256 != 0) {
+        printf("Allocation from a new arena failed\n");
+        return 1;
+    }
+    dallocx(ptrs[0], MALLOCX_ARENA(i));
+    return 0;
+}
+
+/* Buddy blocks are exactly the power of two asked for, and merge back */
+static int test_buddy(void)
+{
+    size_t size;
+    int i, j;
+
+    i = malloc_arena_create_type(MALLOC_ARENA_BUDDY);
+    for(j = 0; j < 1000; j++){
+        size = (size_t) 64 << (j % 12);
+        ptrs[j] = mallocx(size, MALLOCX_ARENA(i));
+        if (ptrs[j] == NULL || (size_t) ptrs[j] % size != 0 ||
+            malloc_usable_size(ptrs[j]) != size || nallocx(size, MALLOCX_ARENA(i)) != size) {
+            printf("Buddy arena gave a wrong block for %zu bytes\n", size);
+            return 1;
+        }
+        ptrs[j][size - 1] = (char) j;
+    }
+    for(j = 0; j < 1000; j += 2){
+        ptrs[j] = realloc(ptrs[j], malloc_usable_size(ptrs[j]) * 2);
+        if (ptrs[j][((size_t) 64 << (j % 12)) - 1] != (char) j) {
+            printf("Buddy realloc lost data\n");
+            return 1;
+        }
+    }
+    for(j = 0; j < 1000; j++){
+        j % 3 ? free(ptrs[j]) : free_deferred(ptrs[j]);
+    }
+    for(j = 0; j < 1000; j++){
+        free_deferred(malloc(24));
+    }
+    /* Everything merged: the whole span is one block again */
+    ptrs[0] = mallocx((size_t) 256 << 20, MALLOCX_ARENA(i));
+    if (ptrs[0] == NULL) {
+        printf("Buddy blocks did not merge back\n");
+        return 1;
+    }
+    dallocx(ptrs[0], 0);
+    return 0;
+}
+
+/* A memfd block: exported, then cloned copy-on-write */
+static int test_memfd(void)
+{
+    struct stat st;
+    size_t offset;
+    char *clone;
+    int fd;
+
+    mallopt(M_MEMFD_THRESHOLD, 1 << 20);
+    /* The memfd header is larger; nallocx must not promise its bytes */
+    if (nallocx((2 << 20) - 64, 0) > malloc_usable_size(ptrs[0] = malloc((2 << 20) - 64))) {
+        printf("nallocx promised more than a memfd block holds\n");
+        return 1;
+    }
+    free(ptrs[0]);
+    ptrs[0] = malloc(4 << 20);
+    memset(ptrs[0], 'a', 4 << 20);
+    fd = malloc_export_fd(ptrs[0], &offset);
+    if (fd < 0 || pread(fd, ptrs[1] = malloc(16), 16, offset + 4096) != 16 || ptrs[1][15] != 'a') {
+        printf("Exported memfd does not hold the block\n");
+        return 1;
+    }
+    close(fd);
+    free(ptrs[1]);
+    /* Whoever has the file mapped keeps all of it across shrink and regrowth */
+    ptrs[1] = malloc(8 << 20);
+    fd = malloc_export_fd(ptrs[1], NULL);
+    xallocx(ptrs[1], 1 << 20, 0, 0);
+    xallocx(ptrs[1], 2 << 20, 0, 0);
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < (8 << 20)) {
+        printf("Growing a shrunk memfd block truncated its file\n");
+        return 1;
+    }
+    close(fd);
+    free(ptrs[1]);
+    if ((clone = malloc_clone(ptrs[0])) == NULL) {
+        printf("Clone failed\n");
+        return 1;
+    }
+    ptrs[0][0] = 'b';
+    clone[1] = 'c';
+    if (clone[0] != 'a' || ptrs[0][1] != 'a' || clone[(4 << 20) - 1] != 'a' ||
+        malloc_export_fd(ptrs[0], NULL) != -1) {
+        printf("Clone is not a separate copy\n");
+        return 1;
+    }
+    ptrs[0] = realloc(ptrs[0], 8 << 20);
+    if (ptrs[0][0] != 'b' || ptrs[0][(4 << 20) - 1] != 'a') {
+        printf("Cloned block lost data on realloc\n");
+        return 1;
+    }
+    free(ptrs[0]);
+    free(clone);
+    mallopt(M_MEMFD_THRESHOLD, 0);
+    return 0;
+}
+
+/* Spilled blocks: past the threshold, then past the budget */
+static int test_spill(void)
+{
+    struct stat st;
+    int i, fd;
+
+    if (malloc_spill("/nonexistent", 1 << 20, 0) != -1 || malloc_spill("/tmp", 1 << 20, 0) != 0) {
+        printf("Spill directory not checked\n");
+        return 1;
+    }
+    ptrs[0] = malloc(4 << 20);
+    memset(ptrs[0], 'a', 4 << 20);
+    malloc_spill("/tmp", 0, 1);
+    ptrs[1] = malloc(512 << 10);
+    for(i = 0; i < 2; i++){
+        fd = malloc_export_fd(ptrs[i], NULL);
+        if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_nlink != 0) {
+            printf("Block %d not spilled to an unlinked file\n", i);
+            return 1;
+        }
+        close(fd);
+    }
+    ptrs[0] = realloc(ptrs[0], 16 << 20);
+    if (ptrs[0][(4 << 20) - 1] != 'a') {
+        printf("Spilled block lost data on realloc\n");
+        return 1;
+    }
+    free(ptrs[0]);
+    free(ptrs[1]);
+    malloc_spill(NULL, 0, 0);
+    return 0;
+}
+
+/* Arenas over a static buffer and over huge pages */
+static int test_backends(void)
+{
+    struct memreq_region region;
+    struct memreq_backend backend;
+    int i, j;
+
+    memreq_static(&backend, &region, region_buffer, sizeof(region_buffer));
+    i = malloc_arena_create_backend(MALLOC_ARENA_FIRST_FIT, &backend);
+    for(j = 0; j < 100; j++){
+        ptrs[j] = mallocx(1000 + j, MALLOCX_ARENA(i));
+        if (i <= 0 || ptrs[j] < region_buffer || ptrs[j] >= region_buffer + sizeof(region_buffer)) {
+            printf("Static arena allocated outside its buffer\n");
+            return 1;
+        }
+    }
+    if (mallocx(8 << 20, MALLOCX_ARENA(i)) != NULL) {
+        printf("Static arena grew past its buffer\n");
+        return 1;
+    }
+    for(j = 0; j < 100; j++){
+        dallocx(ptrs[j], 0);
+    }
+    i = malloc_arena_create_backend(MALLOC_ARENA_FIRST_FIT, &memreq_hugepage);
+    ptrs[0] = mallocx(6 << 20, MALLOCX_ARENA(i));
+    if (i <= 0 || ptrs[0] == NULL) {
+        printf("Hugepage arena failed\n");
+        return 1;
+    }
+    memset(ptrs[0], 1, 6 << 20);
+    dallocx(ptrs[0], 0);
+    /* Its top is decommitted, then committed again on demand */
+    if (malloc_trim(0) != 1 || (ptrs[0] = mallocx(6 << 20, MALLOCX_ARENA(i))) == NULL) {
+        printf("Trimmed arena did not grow back\n");
+        return 1;
+    }
+    memset(ptrs[0], 2, 6 << 20);
+    dallocx(ptrs[0], 0);
+    /* An arena on the break and the sbrk heap take turns moving it */
+    i = malloc_arena_create_backend(MALLOC_ARENA_FIRST_FIT, &memreq_sbrk);
+    for(j = 0; j < 100; j++){
+        ptrs[j] = mallocx(100000, j % 2 ? MALLOCX_ARENA(i) : 0);
+        if (i <= 0 || ptrs[j] == NULL) {
+            printf("Sbrk arena failed\n");
+            return 1;
+        }
+        memset(ptrs[j], j, 100000);
+    }
+    for(j = 0; j < 100; j++){
+        if (ptrs[j][99999] != (char) j) {
+            printf("Sbrk arena overlaps the heap\n");
+            return 1;
+        }
+        dallocx(ptrs[j], 0);
+    }
+    return 0;
+}
+
+/* Blocks count under their tag until freed, and keep it through realloc */
+static int test_tags(void)
+{
+    struct malloc_stats stats;
+    size_t good;
+    int j;
+
+    if (malloc_set_tag(MALLOC_TAG_COUNT) != -1 || malloc_set_tag(3) != 0) {
+        printf("Bad tag accepted\n");
+        return 1;
+    }
+    for(j = 0; j < 100; j++){
+        ptrs[j] = malloc(100 + j * 1000);
+    }
+    ptrs[100] = malloc_tagged(1 << 20, 4);
+    malloc_set_tag(0);
+    ptrs[0] = realloc(ptrs[0], 64 << 10);
+    ptrs[100] = realloc(ptrs[100], 4 << 20);
+    malloc_get_stats(&stats);
+    for(j = 0, good = 0; j < 100; j++){
+        good += malloc_usable_size(ptrs[j]);
+    }
+    if (stats.tags[3].blocks != 100 || stats.tags[3].bytes != good ||
+        stats.tags[4].blocks != 1 || stats.tags[4].bytes != malloc_usable_size(ptrs[100])) {
+        printf("Tag counts off: %zu blocks, %zu bytes\n", stats.tags[3].blocks, stats.tags[3].bytes);
+        return 1;
+    }
+    for(j = 0; j <= 100; j++){
+        free(ptrs[j]);
+    }
+    malloc_get_stats(&stats);
+    if (stats.tags[3].blocks != 0 || stats.tags[3].bytes != 0 || stats.tags[4].blocks != 0) {
+        printf("Freed blocks still counted under their tag\n");
+        return 1;
+    }
+    return 0;
+}
+
+/* Past the soft limit the hook runs once; past the hard one the tag gets nothing */
+static int test_tag_limits(void)
+{
+    char *grown;
+    int j;
+
+    if (malloc_tag_limit(5, 2 << 20, 1 << 20, NULL, NULL) != -1 ||
+        malloc_tag_limit(5, 1 << 20, 2 << 20, count_hook, &hooked) != 0) {
+        printf("Bad tag limits accepted\n");
+        return 1;
+    }
+    for(j = 0; j < 100 && (ptrs[j] = malloc_tagged(64 << 10, 5)) != NULL; j++){
+    }
+    if (j == 100 || j < 20 || errno != ENOMEM || hooked != 1) {
+        printf("Tag limits not kept: %d blocks, hook ran %d times\n", j, hooked);
+        return 1;
+    }
+    malloc_set_tag(5);
+    grown = realloc(ptrs[0], 4 << 20);
+    malloc_set_tag(0);
+    if (grown != NULL || malloc_usable_size(ptrs[0]) < (64 << 10) || (ptrs[j] = malloc(64 << 10)) == NULL) {
+        printf("Realloc grew a block past its tag's limit\n");
+        return 1;
+    }
+    free(ptrs[j]);
+    free(ptrs[--j]);
+    if ((ptrs[j] = malloc_tagged(64 << 10, 5)) == NULL) {
+        printf("Tag stayed full after a free\n");
+        return 1;
+    }
+    for(; j >= 0; j--){
+        free(ptrs[j]);
+    }
+    malloc_tag_limit(5, 0, 0, NULL, NULL);
+    return 0;
+}
+
+/* A block moved under its own tag, which is also current, is counted once */
+static int test_tag_limit_move(void)
+{
+    char *blocker;
+
+    malloc_tag_limit(7, 0, 100 << 10, NULL, NULL);
+    malloc_set_tag(7);
+    ptrs[0] = malloc(40 << 10);
+    /* Keep the block from growing in place */
+    blocker = malloc_tagged(4000, 0);
+    ptrs[0] = realloc(ptrs[0], 80 << 10);
+    if (ptrs[0] == NULL) {
+        printf("realloc charged a moved block twice\n");
+        return 1;
+    }
+    free(ptrs[0]);
+    free(blocker);
+    ptrs[0] = malloc(40 << 10);
+    blocker = malloc_tagged(4000, 0);
+    ptrs[0] = rallocx(ptrs[0], 80 << 10, 0);
+    malloc_set_tag(0);
+    if (ptrs[0] == NULL) {
+        printf("rallocx charged a moved block twice\n");
+        return 1;
+    }
+    free(ptrs[0]);
+    free(blocker);
+    malloc_tag_limit(7, 0, 0, NULL, NULL);
+    return 0;
+}
+
+/* Grow one block under tag 6 in steps, while other threads do the same */
+static void *grow_tagged(void *arg)
+{
+    char *block = malloc_tagged(4096, 6), *grown;
+    size_t size;
+
+    (void) arg;
+    for(size = 8192; block != NULL && size <= (1 << 20); size += 4096){
+        if ((grown = realloc(block, size)) == NULL) {
+            break;
+        }
+        block = grown;
+    }
+    return block;
+}
+
+/* Threads growing blocks at once cannot take a tag past its hard limit together */
+static int test_tag_limit_race(void)
+{
+    pthread_t threads[8];
+    struct malloc_stats stats;
+    void *blocks[8];
+    int i;
+
+    malloc_tag_limit(6, 0, 2 << 20, NULL, NULL);
+    for(i = 0; i < 8; i++){
+        pthread_create(&threads[i], NULL, grow_tagged, NULL);
+    }
+    for(i = 0; i < 8; i++){
+        pthread_join(threads[i], &blocks[i]);
+    }
+    malloc_get_stats(&stats);
+    /* Every block may round its request up by a page */
+    if (stats.tags[6].bytes > (2 << 20) + 8 * 4096) {
+        printf("Racing reallocs took tag 6 to %zu bytes\n", stats.tags[6].bytes);
+        return 1;
+    }
+    for(i = 0; i < 8; i++){
+        free(blocks[i]);
+    }
+    malloc_tag_limit(6, 0, 0, NULL, NULL);
+    return 0;
+}
+
+static int (*const tests[])(void) = {
+    test_good_size, test_allocx, test_realloc_used, test_grow_headroom, test_zero_pool,
+    test_parallel, test_free_async, test_deferred, test_hint, test_size_classes,
+    test_placement, test_arenas, test_buddy, test_memfd, test_spill, test_backends,
+    test_tags, test_tag_limits, test_tag_limit_move, test_tag_limit_race,
+};
+
+int main() {
+    unsigned i;
+    int failed = 0;
+
+    /* Run them all, so one failure does not hide the rest */
+    for(i = 0; i < sizeof(tests) / sizeof(tests[0]); i++){
+        failed |= tests[i]();
+    }
+    return failed;
+}
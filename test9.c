@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "malloc.h"
+
+#define NUM_MALLOCS 200
+#define BIG (1 << 20)
+#define NUM_THREADS 8
+#define NUM_SLOTS 64
+#define NUM_ROUNDS 20000
+
+/* Large blocks moving through the mapping cache from several threads at once */
+static void *churn(void *arg)
+{
+    unsigned seed = (unsigned) (size_t) arg;
+    char* slots[NUM_SLOTS] = { 0 };
+    size_t sizes[NUM_SLOTS] = { 0 };
+    size_t size;
+    int i, s;
+
+    for(i = 0; i < NUM_ROUNDS; i++){
+        s = rand_r(&seed) % NUM_SLOTS;
+        size = 1 + rand_r(&seed) % (300 << 10);
+        if (slots[s] != NULL && (slots[s][0] != (char) s || slots[s][sizes[s] - 1] != (char) s)) {
+            return "block changed under its owner";
+        }
+        switch (rand_r(&seed) % 5) {
+        case 0:
+            free(slots[s]);
+            slots[s] = malloc(size);
+            break;
+        case 1:
+            slots[s] = realloc(slots[s], size);
+            break;
+        case 2:
+            free(slots[s]);
+            slots[s] = calloc(size, 1);
+            if (slots[s] != NULL && slots[s][size / 2] != 0) {
+                return "calloc returned dirty memory";
+            }
+            break;
+        case 3:
+            free(slots[s]);
+            slots[s] = aligned_alloc(4096, size);
+            break;
+        default:
+            free(slots[s]);
+            slots[s] = NULL;
+            continue;
+        }
+        if (NULL == slots[s]) {
+            return "allocation failed";
+        }
+        sizes[s] = size;
+        memset(slots[s], s, size);
+    }
+    for(s = 0; s < NUM_SLOTS; s++){
+        free(slots[s]);
+    }
+    return NULL;
+}
+
+int main() {
+    int i, j;
+    char* ptrs[NUM_MALLOCS];
+    pthread_t threads[NUM_THREADS];
+    void *error;
+
+    for(i = 0; i < NUM_MALLOCS; i++){
+        ptrs[i] = (char*) calloc(BIG + i * 4096, 1);
+        for (j = 0; j < BIG + i * 4096; j += 4096) {
+            if (ptrs[i][j] != 0) {
+                printf("calloc returned dirty memory\n");
+                return 1;
+            }
+            ptrs[i][j] = i;
+        }
+        /* Hand a mapping back to be reused by the next calloc */
+        if (i % 2 == 1) {
+            free(ptrs[i]);
+            ptrs[i] = NULL;
+        }
+    }
+
+    for(i = 0; i < NUM_MALLOCS; i += 2){
+        ptrs[i] = (char*) realloc(ptrs[i], 3 * BIG);
+        if (ptrs[i][0] != (char) i || ptrs[i][BIG - 4096] != (char) i) {
+            printf("realloc lost data\n");
+            return 1;
+        }
+    }
+
+    for(i = 0; i < NUM_MALLOCS; i++) {
+        free(ptrs[i]);
+    }
+
+    for(i = 0; i < NUM_THREADS; i++){
+        pthread_create(&threads[i], NULL, churn, (void*) (size_t) (i + 1));
+    }
+    for(i = 0; i < NUM_THREADS; i++){
+        pthread_join(threads[i], &error);
+        if (error != NULL) {
+            printf("Thread %d: %s\n", i, (char*) error);
+            return 1;
+        }
+    }
+
+    return 0;
+}